@@ -0,0 +1,451 @@
+#include "archive.h"
+
+#include <cctype>
+#include <cstring>
+#include <string>
+using namespace cv;
+
+
+namespace TextureFeature
+{
+
+static const char MAGIC[8] = {'T','F','A','R','C','H','I','V'};
+
+//
+// crc32 (the zlib / png one), chained: crc32(crc32(0,a),b) == crc32(0,ab)
+//
+struct CrcTable
+{
+    unsigned t[256];
+    CrcTable()
+    {
+        for (unsigned n=0; n<256; n++)
+        {
+            unsigned c = n;
+            for (int k=0; k<8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : (c >> 1);
+            t[n] = c;
+        }
+    }
+};
+static const CrcTable crcTable;
+
+static unsigned crc32(unsigned crc, const void *data, size_t len)
+{
+    const uchar *p = (const uchar*)data;
+    unsigned c = crc ^ 0xffffffffu;
+    for (size_t i=0; i<len; i++)
+        c = crcTable.t[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+//
+// the payload streams, they keep the checksum and the size along.
+//
+struct Out
+{
+    FILE *f;
+    unsigned crc;
+    int64 size;
+    bool ok;
+
+    Out(FILE *f) : f(f), crc(0), size(0), ok(true) {}
+
+    void put(const void *p, size_t n)
+    {
+        if (!ok || n == 0)
+            return;
+        ok = (fwrite(p, 1, n, f) == n);
+        crc = crc32(crc, p, n);
+        size += int64(n);
+    }
+    void put(int v) { put(&v, sizeof(int)); }
+};
+
+struct In
+{
+    FILE *f;
+    unsigned crc;
+    int64 left;
+    bool ok;
+
+    In(FILE *f, int64 size) : f(f), crc(0), left(size), ok(true) {}
+
+    bool get(void *p, size_t n)
+    {
+        if (!ok || n == 0)
+            return ok;
+        ok = (int64(n) <= left) && (fread(p, 1, n, f) == n);
+        if (ok)
+        {
+            crc = crc32(crc, p, n);
+            left -= int64(n);
+        }
+        return ok;
+    }
+    int get()
+    {
+        int v = 0;
+        get(&v, sizeof(int));
+        return v;
+    }
+};
+
+
+void Archive::clear()
+{
+    entries.clear();
+    key = "";
+}
+
+Archive::Entry &Archive::put(int kind)
+{
+    CV_Assert(!key.empty() && "an archive entry needs a key first");
+    Entry &e = entries[key];
+    e = Entry();
+    e.kind = kind;
+    key = "";
+    return e;
+}
+
+// a Mat, that does not own its memory (wrapping a vector, or a mapping), gets copied
+static Mat keep(const Mat &m)
+{
+    CV_Assert(m.dims <= 2);
+    return (m.u || !m.data) ? m : m.clone();
+}
+
+Archive &Archive::operator << (const String &s)
+{
+    if (key.empty())
+    {
+        key = s;
+        return *this;
+    }
+    Entry &e = put(STRING);
+    e.mats.push_back(s.empty() ? Mat() : Mat(1, int(s.size()), CV_8U, (void*)s.c_str()).clone());
+    return *this;
+}
+
+Archive &Archive::operator << (int v)
+{
+    put(INT).mats.push_back(Mat(1, 1, CV_32S, Scalar(v)));
+    return *this;
+}
+
+Archive &Archive::operator << (double v)
+{
+    put(REAL).mats.push_back(Mat(1, 1, CV_64F, Scalar(v)));
+    return *this;
+}
+
+Archive &Archive::operator << (const Mat &v)
+{
+    put(MAT).mats.push_back(keep(v));
+    return *this;
+}
+
+Archive &Archive::operator << (const std::vector<Mat> &v)
+{
+    Entry &e = put(MATS);
+    for (size_t i=0; i<v.size(); i++)
+        e.mats.push_back(keep(v[i]));
+    return *this;
+}
+
+Archive::Node Archive::operator [] (const String &k) const
+{
+    std::map<String, Entry>::const_iterator it = entries.find(k);
+    if (it == entries.end())
+        return Node();
+    return Node(&(it->second));
+}
+
+
+static double number(const Archive::Entry *e)
+{
+    if (!e || e->mats.empty() || (e->kind != Archive::INT && e->kind != Archive::REAL))
+        return 0;
+    return e->kind == Archive::INT ? double(e->mats[0].at<int>(0)) : e->mats[0].at<double>(0);
+}
+
+void Archive::Node::operator >> (int &v) const
+{
+    v = cvRound(number(e)); // same as FileStorage for reals
+}
+
+void Archive::Node::operator >> (bool &v) const
+{
+    v = (number(e) != 0);
+}
+
+void Archive::Node::operator >> (float &v) const
+{
+    v = float(number(e));
+}
+
+void Archive::Node::operator >> (double &v) const
+{
+    v = number(e);
+}
+
+void Archive::Node::operator >> (String &v) const
+{
+    v = "";
+    if (e && e->kind == STRING && !e->mats.empty() && !e->mats[0].empty())
+        v = String((const char*)e->mats[0].ptr(), e->mats[0].total());
+}
+
+void Archive::Node::operator >> (Mat &v) const
+{
+    v.release();
+    if (e && e->kind == MAT && !e->mats.empty())
+        v = e->mats[0];
+}
+
+void Archive::Node::operator >> (std::vector<Mat> &v) const
+{
+    v.clear();
+    if (e && (e->kind == MATS || e->kind == MAT))
+        v = e->mats;
+}
+
+
+bool Archive::isText(const String &fn)
+{
+    std::string f = fn;
+    for (size_t i=0; i<f.size(); i++)
+        f[i] = char(tolower(f[i]));
+    if (f.size() > 3 && f.substr(f.size()-3) == ".gz")
+        f = f.substr(0, f.size()-3);
+    size_t dot = f.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    std::string ext = f.substr(dot);
+    return ext == ".xml" || ext == ".yml" || ext == ".yaml" || ext == ".json";
+}
+
+//
+// the header goes last, once the size and the checksum are known.
+//
+bool Archive::writeBinary(FILE *f) const
+{
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, 8);
+    h.version = VERSION;
+    h.entries = int(entries.size());
+    strncpy(h.tag, tag.c_str(), TAGLEN-1);
+    if (fwrite(&h, 1, HEADER, f) != size_t(HEADER))
+        return false;
+
+    Out out(f);
+    std::map<String, Entry>::const_iterator it = entries.begin();
+    for (; it != entries.end() && out.ok; ++it)
+    {
+        const Entry &e = it->second;
+        out.put(int(it->first.size()));
+        out.put(it->first.c_str(), it->first.size());
+        out.put(e.kind);
+        out.put(int(e.mats.size()));
+        for (size_t i=0; i<e.mats.size(); i++)
+        {
+            const Mat &m = e.mats[i];
+            out.put(m.type());
+            out.put(m.rows);
+            out.put(m.cols);
+            size_t rowbytes = m.cols * m.elemSize();
+            if (m.isContinuous())
+                out.put(m.ptr(), m.rows * rowbytes);
+            else for (int r=0; r<m.rows; r++)
+                out.put(m.ptr(r), rowbytes);
+        }
+    }
+    if (! out.ok)
+        return false;
+
+    h.crc = out.crc;
+    h.size = out.size;
+    return (fseek(f, 0, SEEK_SET) == 0)
+        && (fwrite(&h, 1, HEADER, f) == size_t(HEADER));
+}
+
+//
+// the Mats get read straight into their own memory, no intermediate buffer.
+//
+bool Archive::readBinary(FILE *f)
+{
+    Header h;
+    if (fread(&h, 1, HEADER, f) != size_t(HEADER))
+        return false;
+    if (memcmp(h.magic, MAGIC, 8) != 0 || h.version < 1 || h.version > VERSION || h.entries < 0 || h.size < 0)
+        return false;
+
+    In in(f, h.size);
+    for (int n=0; n<h.entries && in.ok; n++)
+    {
+        int len = in.get();
+        if (len <= 0 || len > 1024)
+            return false;
+        std::vector<char> name(len);
+        in.get(&name[0], size_t(len));
+
+        Entry e;
+        e.kind = in.get();
+        int count = in.get();
+        if (e.kind <= NONE || e.kind > MATS || count < 0 || in.left < int64(count) * 3 * int64(sizeof(int)))
+            return false;
+        for (int i=0; i<count && in.ok; i++)
+        {
+            int type = in.get();
+            int rows = in.get();
+            int cols = in.get();
+            if (rows < 0 || cols < 0 || type != CV_MAT_TYPE(type))
+                return false;
+            int64 bytes = int64(rows) * cols * CV_ELEM_SIZE(type);
+            if (bytes > in.left)
+                return false;
+            Mat m;
+            if (bytes > 0)
+            {
+                m.create(rows, cols, type);
+                in.get(m.ptr(), size_t(bytes));
+            }
+            e.mats.push_back(m);
+        }
+        entries[String(&name[0], size_t(len))] = e;
+    }
+    if (!in.ok || in.left != 0 || in.crc != h.crc)
+        return false;
+
+    h.tag[TAGLEN-1] = 0;
+    tag = h.tag;
+    return true;
+}
+
+bool Archive::save(const String &fn) const
+{
+    if (isText(fn))
+    {
+        FileStorage fs(fn, FileStorage::WRITE);
+        if (! fs.isOpened())
+            return false;
+        write(fs);
+        fs.release();
+        return true;
+    }
+
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (! f)
+        return false;
+    bool ok = writeBinary(f);
+    return (fclose(f) == 0) && ok;
+}
+
+bool Archive::load(const String &fn)
+{
+    clear();
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (! f)
+        return false;
+    char magic[8] = {0};
+    bool binary = (fread(magic, 1, 8, f) == 8) && (memcmp(magic, MAGIC, 8) == 0);
+    if (binary)
+    {
+        bool ok = (fseek(f, 0, SEEK_SET) == 0) && readBinary(f);
+        fclose(f);
+        if (! ok)
+            clear();
+        return ok;
+    }
+    fclose(f);
+
+    try
+    {
+        FileStorage fs(fn, FileStorage::READ);
+        return fs.isOpened() && read(fs.root());
+    }
+    catch (const cv::Exception &)
+    {
+        clear();
+        return false;
+    }
+}
+
+void Archive::write(FileStorage &fs) const
+{
+    fs << "archive_tag" << tag;
+    fs << "archive_version" << int(VERSION);
+    std::map<String, Entry>::const_iterator it = entries.begin();
+    for (; it != entries.end(); ++it)
+    {
+        Node n(&(it->second));
+        switch(it->second.kind)
+        {
+            case INT:    { int v; n >> v; fs << it->first << v; break; }
+            case REAL:   { double v; n >> v; fs << it->first << v; break; }
+            case STRING: { String v; n >> v; fs << it->first << v; break; }
+            case MAT:    fs << it->first << it->second.mats[0]; break;
+            case MATS:   fs << it->first << it->second.mats; break;
+        }
+    }
+}
+
+bool Archive::read(const FileNode &root)
+{
+    clear();
+    if (! root.isMap())
+        return false;
+    for (FileNodeIterator it=root.begin(); it!=root.end(); ++it)
+    {
+        FileNode n = *it;
+        String name = n.name();
+        if (name == "archive_tag")
+        {
+            n >> tag;
+            continue;
+        }
+        if (name == "archive_version")
+            continue;
+
+        Entry e;
+        if (n.isInt())
+        {
+            e.kind = INT;
+            e.mats.push_back(Mat(1, 1, CV_32S, Scalar(int(n))));
+        }
+        else if (n.isReal())
+        {
+            e.kind = REAL;
+            e.mats.push_back(Mat(1, 1, CV_64F, Scalar(double(n))));
+        }
+        else if (n.isString())
+        {
+            String s = n;
+            e.kind = STRING;
+            e.mats.push_back(s.empty() ? Mat() : Mat(1, int(s.size()), CV_8U, (void*)s.c_str()).clone());
+        }
+        else if (n.isMap())
+        {
+            Mat m;
+            n >> m;
+            e.kind = MAT;
+            e.mats.push_back(m);
+        }
+        else if (n.isSeq())
+        {
+            e.kind = MATS;
+            for (FileNodeIterator s=n.begin(); s!=n.end(); ++s)
+            {
+                Mat m;
+                (*s) >> m;
+                e.mats.push_back(m);
+            }
+        }
+        else continue;
+        entries[name] = e;
+    }
+    return true;
+}
+
+} // TextureFeature
@@ -0,0 +1,122 @@
+#ifndef __Archive_onboard__
+#define __Archive_onboard__
+
+#include <cstdio>
+#include <map>
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+namespace TextureFeature
+{
+
+//
+// a flat, named store for the model parameters (numbers, strings, Mats),
+//   used the same way as a FileStorage:
+//
+//     ar << "key" << value;
+//     ar["key"] >> value;    // a missing key gives 0, an empty string or Mat
+//
+// written to disk, it is a versioned binary container, the Mats go in as raw data:
+//
+//   [header, 64 bytes][entry 0][entry 1]...
+//   entry: name, kind, count, then per Mat: type, rows, cols, the pixels
+//
+// the header holds a type tag (the model that wrote it), the entry count,
+//   the payload size and its crc32, so a truncated or damaged file gets rejected.
+// filenames ending in .xml, .yml, .yaml or .json (also .gz) go through FileStorage instead,
+//   the text export, it can be read back, too.
+//
+// Mats are kept by reference until the archive gets written, like any other Mat copy,
+//   only those, that do not own their memory (Mat(vector), a mapped file) get copied.
+//
+struct Archive
+{
+    enum { VERSION=1, HEADER=64, TAGLEN=32 };
+    enum Kind { NONE=0, INT, REAL, STRING, MAT, MATS };
+
+    struct Header
+    {
+        char magic[8];     // "TFARCHIV"
+        int version;
+        int entries;
+        unsigned crc;      // crc32 of the payload
+        int reserved;
+        cv::int64 size;    // payload bytes, following the header
+        char tag[TAGLEN];  // 0 terminated
+    };
+
+    struct Entry
+    {
+        int kind;
+        std::vector<cv::Mat> mats; // numbers and strings are a 1x1 / 1xn Mat, too
+        Entry() : kind(NONE) {}
+    };
+
+    struct Node
+    {
+        Node(const Entry *e=0) : e(e) {}
+
+        bool empty() const { return e == 0; }
+        int kind() const { return e ? e->kind : NONE; }
+
+        void operator >> (int &v) const;
+        void operator >> (bool &v) const;
+        void operator >> (float &v) const;
+        void operator >> (double &v) const;
+        void operator >> (cv::String &v) const;
+        void operator >> (cv::Mat &v) const;
+        void operator >> (std::vector<cv::Mat> &v) const;
+        template <class T> void operator >> (cv::Mat_<T> &v) const
+        {
+            cv::Mat m;
+            *this >> m;
+            v = m;
+        }
+
+    private:
+        const Entry *e;
+    };
+
+    cv::String tag; // which model wrote it
+
+    Archive(const cv::String &tag="") : tag(tag) {}
+
+    // a key, or a string value, if a key is pending
+    Archive &operator << (const cv::String &s);
+    Archive &operator << (const char *s) { return *this << cv::String(s); }
+    Archive &operator << (int v);
+    Archive &operator << (bool v) { return *this << int(v); }
+    Archive &operator << (float v) { return *this << double(v); }
+    Archive &operator << (double v);
+    Archive &operator << (const cv::Mat &v);
+    Archive &operator << (const std::vector<cv::Mat> &v);
+
+    Node operator [] (const cv::String &key) const;
+
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+    void clear();
+
+    // binary, or FileStorage text, depending on the extension
+    bool save(const cv::String &fn) const;
+    bool load(const cv::String &fn);
+
+    // the text export, (any FileStorage opened for writing / its root node)
+    void write(cv::FileStorage &fs) const;
+    bool read(const cv::FileNode &root);
+
+    static bool isText(const cv::String &fn);
+
+private:
+    std::map<cv::String, Entry> entries;
+    cv::String key; // pending, waiting for its value
+
+    Entry &put(int kind);
+    bool writeBinary(FILE *f) const;
+    bool readBinary(FILE *f);
+};
+
+} // TextureFeature
+
+#endif // __Archive_onboard__
@@ -1,4 +1,9 @@
 #include <set>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_set>
 using namespace std;
 
 
@@ -8,7 +13,16 @@ using namespace std;
 #include <opencv2/flann/miniflann.hpp>
 using namespace cv;
 
+#if defined(HAVE_SSE) || defined(HAVE_AVX2)
+ #include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+ #include <intrin.h>
+#endif
+
 #include "texturefeature.h"
+#include "hnsw.h"
+#include "gallery.h"
 
 using namespace TextureFeature;
 
@@ -16,6 +30,39 @@ namespace TextureFeatureImpl
 {
 
 
+//
+// k best (smallest) distances, kept sorted
+//
+struct TopK
+{
+    size_t k;
+    vector<float> dist;
+    vector<int> id;
+
+    TopK(int k) : k(k) {}
+
+    inline void push(float d, int i)
+    {
+        if (dist.size() == k && d >= dist.back())
+            return;
+        size_t p = dist.size();
+        if (p < k)
+        {
+            dist.push_back(d);
+            id.push_back(i);
+        }
+        else p = k-1; // drop the worst one
+        for (; p>0 && dist[p-1]>d; p--)
+        {
+            dist[p] = dist[p-1];
+            id[p] = id[p-1];
+        }
+        dist[p] = d;
+        id[p] = i;
+    }
+};
+
+
 static Mat tofloat(const Mat &src)
 {
     if ( src.type() == CV_32F )
@@ -27,40 +74,379 @@ static Mat tofloat(const Mat &src)
 }
 
 
-struct ClassifierNearest : public TextureFeature::Classifier
+// a contiguous float row
+static Mat floatrow(const Mat &src)
 {
-    Mat features;
-    Mat labels;
-    int flag;
+    Mat m = tofloat(src);
+    if (! m.isContinuous())
+        m = m.clone();
+    return m.reshape(1,1);
+}
+
+
+//
+// histogram distances over contiguous float rows,
+//   avx2/fma (8 lanes) and sse (4 lanes) main loops with a scalar tail.
+//   the results match compareHist() (with the 1st arg as the query).
+//
+#if defined(HAVE_AVX2)
+static inline float hsum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    float f[4]; _mm_storeu_ps(f, s);
+    return f[0] + f[1] + f[2] + f[3];
+}
+#endif
+#if defined(HAVE_SSE)
+static inline float hsum(__m128 v)
+{
+    float f[4]; _mm_storeu_ps(f, v);
+    return f[0] + f[1] + f[2] + f[3];
+}
+#endif
+
+static float hist_dot(const float *a, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
+        s8 = _mm256_fmadd_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k), s8);
+    s += hsum(s8);
+#endif
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
+        s4 = _mm_add_ps(s4, _mm_mul_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k)));
+    s += hsum(s4);
+#endif
+    for (; k<n; k++)
+        s += a[k] * b[k];
+    return s;
+}
+
+// sum((a-b)^2 * ia), ia = 1/a (0 for empty bins), precalculated once per query
+static float hist_chi(const float *a, const float *ia, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k));
+        s8 = _mm256_fmadd_ps(_mm256_mul_ps(d, d), _mm256_loadu_ps(ia+k), s8);
+    }
+    s += hsum(s8);
+#endif
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
+    {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k));
+        s4 = _mm_add_ps(s4, _mm_mul_ps(_mm_mul_ps(d, d), _mm_loadu_ps(ia+k)));
+    }
+    s += hsum(s4);
+#endif
+    for (; k<n; k++)
+    {
+        float d = a[k] - b[k];
+        s += d * d * ia[k];
+    }
+    return s;
+}
+
+static float hist_min(const float *a, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
+        s8 = _mm256_add_ps(s8, _mm256_min_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k)));
+    s += hsum(s8);
+#endif
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
+        s4 = _mm_add_ps(s4, _mm_min_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k)));
+    s += hsum(s4);
+#endif
+    for (; k<n; k++)
+        s += std::min(a[k], b[k]);
+    return s;
+}
+
+//
+// pairwise, nothing precalculated (verification)
+//
+static double hist_pair(int flag, const float *a, const float *b, int n)
+{
+    switch(flag)
+    {
+        case HISTCMP_CHISQR:
+        {
+            Mat_<float> ia(1, n);
+            for (int j=0; j<n; j++)
+                ia(j) = std::abs(a[j]) > DBL_EPSILON ? 1.0f/a[j] : 0.0f;
+            return hist_chi(a, ia[0], b, n);
+        }
+        case HISTCMP_HELLINGER:
+        {
+            double s1=0, s2=0, r=0;
+            for (int j=0; j<n; j++)
+            {
+                s1 += a[j];
+                s2 += b[j];
+                r  += std::sqrt(a[j] * b[j]);
+            }
+            s1 *= s2;
+            s1 = std::abs(s1) > FLT_EPSILON ? 1.0/std::sqrt(s1) : 1.0;
+            return std::sqrt(std::max(1.0 - r*s1, 0.0));
+        }
+        case HISTCMP_INTERSECT:
+            return hist_min(a, b, n);
+    }
+    return compareHist(Mat(1, n, CV_32F, (void*)a), Mat(1, n, CV_32F, (void*)b), flag);
+}
+
+//
+// binary descriptors: the number of differing bits.
+//   avx2: a nibble lookup per byte (Mula), summed with sad, 32 bytes per step,
+//   else popcnt on 8 byte words, with a byte tail.
+//
+static inline int popcount64(uint64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return int(__popcnt64(x));
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return int((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static int hamming(const uchar *a, const uchar *b, int n)
+{
+    int k = 0, s = 0;
+#if defined(HAVE_AVX2)
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for (; k<=n-32; k+=32)
+    {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+k)), _mm256_loadu_si256((const __m256i*)(b+k)));
+        __m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                    _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+    int64 w[4]; _mm256_storeu_si256((__m256i*)w, acc);
+    s += int(w[0] + w[1] + w[2] + w[3]);
+#endif
+    for (; k<=n-8; k+=8)
+    {
+        uint64 x, y;
+        memcpy(&x, a+k, 8);
+        memcpy(&y, b+k, 8);
+        s += popcount64(x ^ y);
+    }
+    for (; k<n; k++)
+        s += popcount64(uint64(a[k] ^ b[k]));
+    return s;
+}
+
+
+struct ClassifierNearest : public TextureFeature::Classifier, HnswSpace
+{
+    //
+    // L2, L2SQR and cosine get scored against the whole gallery with a single gemm,
+    //   |a-b|^2 = |a|^2 - 2ab + |b|^2, with the gallery norms precomputed.
+    //
+    enum { DENSE_NONE, DENSE_L2, DENSE_L2SQR, DENSE_COS };
 
-    ClassifierNearest(int flag=NORM_L2) : flag(flag) {}
+    Gallery features; // chunked, so update() never copies the rows already there
+    Gallery labels;
+    Gallery norms;    // squared L2 norms of the gallery rows (dense only)
+    int flag;
+    int dense;
+    Ptr<Hnsw> ann; // approximate search on a graph index, instead of scanning the gallery
+    Ptr<GalleryFile> file; // features and labels are views into the mapped file, if attached
+    int dead;         // removed rows, their label is -1 until the next compact()
+
+    // M, efc, ef: the hnsw links per node, build and search beam width (approx only)
+    ClassifierNearest(int flag=NORM_L2, bool approx=false, int M=16, int efc=200, int ef=64)
+        : flag(flag)
+        , dense(flag==NORM_L2 ? DENSE_L2 : flag==NORM_L2SQR ? DENSE_L2SQR : DENSE_NONE)
+        , dead(0)
+    {
+        if (approx)
+            ann = makePtr<Hnsw>(M, efc, ef);
+    }
 
     virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
     {
         return norm(testFeature, trainFeature, flag);
     }
 
-    template <typename Dist>
-    static void nearest(const cv::Mat &testFeature, const cv::Mat &features, int &best, double &mind, const Dist &dis)
+    //
+    // distances of one query to the gallery rows [from..to), the generic (per row) path.
+    //   override, if something can be precalculated per query.
+    //
+    virtual void distanceRow(const Mat &query, int from, int to, float *d) const
+    {
+        for (int r=from; r<to; r++)
+            d[r-from] = float(distance(query, features.row(r)));
+    }
+
+    // per gallery row precalculations for the rows [from..end)
+    virtual void prepare(int from=0)
+    {
+        if (dense == DENSE_NONE || features.empty())
+            return;
+        if (from == 0 && features.type() != CV_32F)
+            features = Gallery(tofloat(features.contiguous()));
+        Mat n(features.rows() - from, 1, CV_32F);
+        for (int r=from; r<features.rows(); r++)
+        {
+            Mat f = features.row(r);
+            n.at<float>(r-from) = float(f.dot(f));
+        }
+        if (from == 0)
+            norms = Gallery(n);
+        else
+            norms.push_back(n);
+    }
+
+    // a copy, removing a row writes into it
+    static Gallery column(const Mat &labels)
+    {
+        return Gallery(labels.reshape(1, int(labels.total())).clone());
+    }
+
+    // removed rows get an 'infinite' distance
+    void bury(float *d, int from, int to) const
+    {
+        if (dead == 0)
+            return;
+        for (int r=from; r<to; r++)
+            if (labels.at<int>(r) < 0)
+                d[r-from] = FLT_MAX;
+    }
+
+    int countDead()
+    {
+        dead = 0;
+        for (int r=0; r<labels.rows(); r++)
+            dead += (labels.at<int>(r) < 0);
+        return dead;
+    }
+
+    // (re-)build the graph for the gallery rows [from..end)
+    void index(int from=0)
+    {
+        if (! ann)
+            return;
+        if (from == 0)
+            ann->clear();
+        ann->add(*this, from, features.rows());
+    }
+
+    // HnswSpace
+    virtual float dist(const Mat &query, int id) const
+    {
+        float d;
+        distanceRow(query, id, id+1, &d);
+        return d;
+    }
+
+    virtual Mat item(int id) const
+    {
+        return features.row(id);
+    }
+
+    virtual bool alive(int id) const
+    {
+        return labels.at<int>(id) >= 0;
+    }
+
+    Mat query(const Mat &testFeature) const
+    {
+        return dense != DENSE_NONE ? tofloat(testFeature).reshape(1,1) : testFeature.reshape(1,1);
+    }
+
+    //
+    // distances of (a batch of) queries to the gallery rows [from..to), one row per query.
+    //   [from..to) should not cross a chunk of the gallery, or it gets copied.
+    //
+    void distances(const Mat &queries, int from, int to, Mat &dist) const
     {
-        mind=DBL_MAX;
-        best = -1;
-        for (int r=0; r<features.rows; r++)
+        gemm(queries, features.rowRange(from, to), 1.0, noArray(), 0.0, dist, GEMM_2_T);
+        Mat gnorm = norms.rowRange(from, to);
+        const float *gn = gnorm.ptr<float>();
+        for (int i=0; i<dist.rows; i++)
         {
-            double d = dis.distance(testFeature, features.row(r));
-            if (d < mind)
+            Mat q = queries.row(i);
+            float qn = float(q.dot(q));
+            float *d = dist.ptr<float>(i);
+            for (int j=0; j<dist.cols; j++)
             {
-                mind = d;
-                best = r;
+                switch(dense)
+                {
+                    case DENSE_L2:    d[j] = std::sqrt(std::max(gn[j] - 2*d[j] + qn, 0.0f)); break;
+                    case DENSE_L2SQR: d[j] = std::max(gn[j] - 2*d[j] + qn, 0.0f); break;
+                    case DENSE_COS:   d[j] = -d[j] / std::sqrt(gn[j] * qn); break;
+                }
             }
+            bury(d, from, to);
         }
     }
+
     // TextureFeature::Classifier
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
     {
         int best = -1;
         double mind=DBL_MAX;
-        nearest(testFeature, features, best, mind, *this);
+        if (ann)
+        {
+            vector<Hnsw::Hit> hits;
+            ann->search(*this, query(testFeature), 1, hits);
+            if (! hits.empty())
+            {
+                mind = hits[0].first;
+                best = hits[0].second;
+            }
+        }
+        else if (dense != DENSE_NONE && !features.empty())
+        {
+            Mat q = query(testFeature);
+            for (int c=0; c<features.chunks(); c++)
+            {
+                int g0 = features.offset(c);
+                Mat dist;
+                distances(q, g0, g0 + features.getChunk(c).rows, dist);
+                double m;
+                Point minLoc;
+                minMaxLoc(dist, &m, 0, &minLoc);
+                if (m < mind && m < FLT_MAX)
+                {
+                    mind = m;
+                    best = g0 + minLoc.x;
+                }
+            }
+        }
+        else if (!features.empty())
+        {
+            Mat_<float> dist(1, features.rows());
+            distanceRow(testFeature, 0, features.rows(), dist[0]);
+            bury(dist[0], 0, features.rows());
+            Point minLoc;
+            minMaxLoc(dist, &mind, 0, &minLoc);
+            best = (mind < FLT_MAX) ? minLoc.x : -1;
+        }
 
         int found = best>-1 ? labels.at<int>(best) : -1;
         results.push_back(float(found));
@@ -69,39 +455,319 @@ struct ClassifierNearest : public TextureFeature::Classifier
         return 3;
     }
 
+    //
+    // tiles of queries x gallery, so a gallery tile gets reused by all queries in a tile,
+    //   the query tiles get spread over the cores.
+    //
+    struct NearestBatch : public ParallelLoopBody
+    {
+        enum { QTILE=32, GTILE=2048 };
+        const ClassifierNearest &cls;
+        const Mat &queries;
+        int k;
+        Mat &results;
+
+        NearestBatch(const ClassifierNearest &cls, const Mat &queries, int k, Mat &results)
+            : cls(cls), queries(queries), k(k), results(results)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int t=range.start; t<range.end; t++)
+            {
+                int q0 = t * QTILE;
+                int q1 = std::min(q0 + QTILE, queries.rows);
+                vector<TopK> best(q1-q0, TopK(k));
+                if (cls.ann)
+                {
+                    vector<Hnsw::Hit> hits;
+                    for (int i=q0; i<q1; i++)
+                    {
+                        cls.ann->search(cls, queries.row(i), k, hits);
+                        for (size_t j=0; j<hits.size(); j++)
+                            best[i-q0].push(hits[j].first, hits[j].second);
+                    }
+                }
+                else if (cls.dense != DENSE_NONE)
+                {
+                    Mat qt = queries.rowRange(q0, q1);
+                    for (int c=0; c<cls.features.chunks(); c++)
+                    {
+                        int end = cls.features.offset(c) + cls.features.getChunk(c).rows;
+                        for (int g0=cls.features.offset(c); g0<end; g0+=GTILE)
+                        {
+                            int g1 = std::min(g0 + GTILE, end);
+                            Mat dist;
+                            cls.distances(qt, g0, g1, dist);
+                            for (int i=0; i<dist.rows; i++)
+                            {
+                                const float *d = dist.ptr<float>(i);
+                                for (int j=0; j<dist.cols; j++)
+                                    if (d[j] < FLT_MAX)
+                                        best[i].push(d[j], g0+j);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    vector<float> dist(cls.features.rows());
+                    for (int i=q0; i<q1 && !dist.empty(); i++)
+                    {
+                        cls.distanceRow(queries.row(i), 0, cls.features.rows(), &dist[0]);
+                        cls.bury(&dist[0], 0, cls.features.rows());
+                        for (size_t g=0; g<dist.size(); g++)
+                            if (dist[g] < FLT_MAX)
+                                best[i-q0].push(dist[g], int(g));
+                    }
+                }
+                for (int i=q0; i<q1; i++)
+                {
+                    const TopK &b = best[i-q0];
+                    float *r = results.ptr<float>(i);
+                    for (size_t j=0; j<b.id.size(); j++)
+                    {
+                        r[3*j]   = float(cls.labels.at<int>(b.id[j]));
+                        r[3*j+1] = b.dist[j];
+                        r[3*j+2] = float(b.id[j]);
+                    }
+                }
+            }
+        }
+    };
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        Mat q = (dense != DENSE_NONE) ? tofloat(queries) : queries;
+        results = Mat(q.rows, 3*k, CV_32F, Scalar(-1));
+        int ntiles = (q.rows + NearestBatch::QTILE - 1) / NearestBatch::QTILE;
+        parallel_for_(Range(0, ntiles), NearestBatch(*this, q, k, results));
+        return results.rows;
+    }
+
+    // an attached file gets the new gallery, too
     virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
     {
-        features = trainFeatures;
-        labels = trainLabels;
+        setGallery(trainFeatures, trainLabels);
         return 1;
     }
 
     virtual int update(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
     {
-        features.push_back(trainFeatures);
-        labels.push_back(trainLabels);
+        int n = features.rows();
+        Mat f = (dense!=DENSE_NONE) ? tofloat(trainFeatures) : trainFeatures;
+        if (file)
+        {
+            if (! file->append(f, trainLabels))
+                return 0;
+            features = Gallery(file->features());
+            labels = Gallery(file->labels());
+        }
+        else
+        {
+            features.push_back(f);
+            labels.push_back(trainLabels.reshape(1, int(trainLabels.total())));
+        }
+        for (size_t i=0; i<trainLabels.total(); i++)
+            dead += (trainLabels.at<int>(int(i)) < 0);
+        prepare(n);
+        index(n);
+        return 1;
+    }
+
+    bool openGallery(const String &fn)
+    {
+        Ptr<GalleryFile> g = makePtr<GalleryFile>();
+        if (! g->open(fn))
+            return false;
+        file = g;
+        features = Gallery(file->features());
+        labels = Gallery(file->labels());
+        countDead();
+        return true;
+    }
+
+    //
+    // a trained gallery gets written to fn, else fn gets opened.
+    //   from now on, update() appends to the file, and save() only stores the path.
+    //
+    virtual bool attachGallery(const String &fn)
+    {
+        if (features.empty())
+        {
+            if (! openGallery(fn))
+                return false;
+            prepare();
+            index();
+            return true;
+        }
+        Ptr<GalleryFile> g = makePtr<GalleryFile>();
+        if (! g->create(fn, features.contiguous(), labels.contiguous()))
+            return false;
+        file = g;
+        features = Gallery(file->features()); // same rows, the norms and the graph stay valid
+        labels = Gallery(file->labels());
+        return true;
+    }
+
+    void saveGallery(Archive &ar) const
+    {
+        if (file)
+        {
+            ar << "gallery" << file->path();
+            return;
+        }
+        ar << "labels" << labels.contiguous();
+        ar << "features" << features.contiguous();
+    }
+
+    void loadGallery(const Archive &ar)
+    {
+        String fn;
+        ar["gallery"] >> fn;
+        file.release();
+        if (!fn.empty() && openGallery(fn))
+            return;
+        Mat l, f;
+        ar["labels"] >> l;
+        ar["features"] >> f;
+        labels = column(l);
+        features = Gallery(f);
+        countDead();
+    }
+
+    //
+    // tombstones only, the rows stay until the owner calls compact().
+    //   a mapped file gets its label overwritten, so other processes see the removal, too.
+    //
+    int kill(int r)
+    {
+        if (labels.at<int>(r) < 0)
+            return 0;
+        if (file)
+            file->setLabel(r, -1);
+        else
+            *labels.ptr<int>(r) = -1;
+        dead ++;
         return 1;
     }
 
+    // the row indices stay valid, until compact() gets called
+    virtual int removeIndex(int r)
+    {
+        CV_Assert(r >= 0 && r < labels.rows());
+        return kill(r);
+    }
+
+    virtual int removeLabel(int label)
+    {
+        int n = 0;
+        for (int r=0; r<labels.rows(); r++)
+            if (labels.at<int>(r) == label)
+                n += kill(r);
+        return n;
+    }
+
+    virtual int removed() const
+    {
+        return dead;
+    }
+
+    // the rows of g, that are still alive
+    Gallery survivors(const Gallery &g) const
+    {
+        Gallery s;
+        for (int r=0; r<labels.rows(); r++)
+            if (labels.at<int>(r) >= 0)
+                s.push_back(g.row(r));
+        return s;
+    }
+
+    //
+    // drop the dead rows for good, the row indices change, so the graph gets rebuilt.
+    //
+    virtual int compact()
+    {
+        if (dead == 0)
+            return 0;
+        int n = dead;
+        Gallery f = survivors(features), l = survivors(labels);
+        if (file)
+        {
+            file->rewrite(f.contiguous(), l.contiguous());
+            features = Gallery(file->features());
+            labels = Gallery(file->labels());
+        }
+        else
+        {
+            features = f;
+            labels = l;
+        }
+        dead = 0;
+        prepare();
+        index();
+        return n;
+    }
+
+    //
+    // replace all gallery rows at once (e.g. after a change of the projection)
+    //
+    void setGallery(const Mat &feat, const Mat &lab)
+    {
+        if (file)
+        {
+            file->rewrite(feat, lab);
+            features = Gallery(file->features());
+            labels = Gallery(file->labels());
+        }
+        else
+        {
+            features = Gallery(feat);
+            labels = column(lab);
+        }
+        countDead();
+        prepare();
+        index();
+    }
+
+    // a new basis for the projection classifiers: g' = g * R + o
+    void reproject(const Mat &R, const Mat &o)
+    {
+        Mat g = features.contiguous();
+        if (! g.empty())
+            g = g * R + repeat(o, g.rows, 1);
+        setGallery(g, labels.contiguous());
+    }
+
+    // the graph is saved along, rebuilding it for a large gallery takes a while
+    void loadIndex(const Archive &ar)
+    {
+        if (ann && !(ann->load(ar) && ann->size() == features.rows()))
+            index();
+    }
+
     // Serialize
-    virtual bool save(FileStorage &fs) const
+    virtual bool save(Archive &ar) const
     {
-        fs << "labels" << labels;
-        fs << "features" << features;
+        saveGallery(ar);
+        if (ann) ann->save(ar);
         return true;
     }
 
-    virtual bool load(const FileStorage &fs)
+    virtual bool load(const Archive &ar)
     {
-        fs["labels"] >> labels;
-        fs["features"] >> features;
+        loadGallery(ar);
+        prepare();
+        loadIndex(ar);
         return ! features.empty();
     }
 };
 
 struct ClassifierNearestFloat : public ClassifierNearest
 {
-    ClassifierNearestFloat(int flag=NORM_L2) : ClassifierNearest(flag) {}
+    ClassifierNearestFloat(int flag=NORM_L2, bool approx=false, int M=16, int efc=200, int ef=64)
+        : ClassifierNearest(flag, approx, M, efc, ef)
+    {}
 
     // TextureFeature::Classifier
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
@@ -109,10 +775,20 @@ struct ClassifierNearestFloat : public ClassifierNearest
         return ClassifierNearest::predict(tofloat(testFeature), results);
     }
 
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        return ClassifierNearest::predictBatch(tofloat(queries), k, results);
+    }
+
     virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
     {
         return ClassifierNearest::train(tofloat(trainFeatures), trainLabels);
     }
+
+    virtual int update(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
+    {
+        return ClassifierNearest::update(tofloat(trainFeatures), trainLabels);
+    }
 };
 
 
@@ -124,14 +800,146 @@ struct ClassifierNearestFloat : public ClassifierNearest
 //
 struct ClassifierHist : public ClassifierNearestFloat
 {
-    ClassifierHist(int flag=HISTCMP_CHISQR)
-        : ClassifierNearestFloat(flag)
-    {}
+    Gallery trans; // per gallery row: sqrt (hellinger) or log (kl)
+    Gallery sums;  // per gallery row: sum (hellinger)
+
+    ClassifierHist(int flag=HISTCMP_CHISQR, bool approx=false, int M=16, int efc=200, int ef=64)
+        : ClassifierNearestFloat(flag, approx, M, efc, ef)
+    {
+        dense = DENSE_NONE; // the flags overlap with NORM_L2 / NORM_L2SQR
+    }
 
     // ClassifierNearest
     virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
     {
-         return compareHist(testFeature, trainFeature, flag);
+        Mat a = floatrow(testFeature), b = floatrow(trainFeature);
+        return hist_pair(flag, a.ptr<float>(), b.ptr<float>(), a.cols);
+    }
+
+    virtual void prepare(int from=0)
+    {
+        if (from == 0)
+        {
+            trans.release();
+            sums.release();
+        }
+        if (flag != HISTCMP_HELLINGER && flag != HISTCMP_KL_DIV)
+            return;
+        Mat tr, sm;
+        for (int r=from; r<features.rows(); r++)
+        {
+            Mat f = features.row(r), t;
+            if (flag == HISTCMP_HELLINGER)
+            {
+                cv::sqrt(f, t);
+                sm.push_back(float(sum(f)[0]));
+            }
+            else
+            {
+                t = f.clone();
+                float *p = t.ptr<float>();
+                for (int j=0; j<t.cols; j++)
+                    p[j] = std::log(std::abs(p[j]) > DBL_EPSILON ? p[j] : 1e-10f);
+            }
+            tr.push_back(t);
+        }
+        if (from == 0)
+        {
+            trans = Gallery(tr);
+            sums = Gallery(sm);
+            return;
+        }
+        trans.push_back(tr);
+        sums.push_back(sm);
+    }
+
+    //
+    // the per query part, row 0: the query, row 1: its transform (sqrt, 1/q, or the cleaned p for kl),
+    //   the last column of row 0: a scalar (the sum, or p*log(p)).
+    //   the graph search does this once per query, not once per hop.
+    //
+    virtual Mat prepareQuery(const Mat &query) const
+    {
+        Mat q = floatrow(query);
+        int n = q.cols;
+        Mat pq = Mat::zeros(2, n+1, CV_32F);
+        q.copyTo(pq(Rect(0, 0, n, 1)));
+        const float *a = q.ptr<float>();
+        float *t = pq.ptr<float>(1);
+        switch(flag)
+        {
+            case HISTCMP_HELLINGER:
+                for (int j=0; j<n; j++)
+                    t[j] = std::sqrt(a[j]);
+                pq.at<float>(0, n) = float(sum(q)[0]);
+                break;
+            case HISTCMP_KL_DIV:
+            {
+                double plogp = 0;
+                for (int j=0; j<n; j++)
+                {
+                    t[j] = std::abs(a[j]) > DBL_EPSILON ? a[j] : 0.0f;
+                    if (t[j] != 0) plogp += t[j] * std::log(t[j]);
+                }
+                pq.at<float>(0, n) = float(plogp);
+                break;
+            }
+            case HISTCMP_CHISQR:
+                for (int j=0; j<n; j++)
+                    t[j] = std::abs(a[j]) > DBL_EPSILON ? 1.0f/a[j] : 0.0f;
+                break;
+        }
+        return pq;
+    }
+
+    // distances of a prepared query to the gallery rows [from..to)
+    void distancePrepared(const Mat &pq, int from, int to, float *d) const
+    {
+        int n = pq.cols - 1;
+        const float *q = pq.ptr<float>(0), *t = pq.ptr<float>(1);
+        switch(flag)
+        {
+            case HISTCMP_HELLINGER:
+            {
+                // 1 - sum(sqrt(a*b)) / sqrt(sum(a)*sum(b)), a dot product on the rooted data
+                double s1 = q[n];
+                for (int r=from; r<to; r++)
+                {
+                    double s = s1 * sums.at<float>(r);
+                    s = std::abs(s) > FLT_EPSILON ? 1.0/std::sqrt(s) : 1.0;
+                    double dot = hist_dot(t, trans.ptr<float>(r), n);
+                    d[r-from] = float(std::sqrt(std::max(1.0 - dot*s, 0.0)));
+                }
+                return;
+            }
+            case HISTCMP_KL_DIV:
+                // sum(p*log(p/q)) = sum(p*log(p)) - p.log(q)
+                for (int r=from; r<to; r++)
+                    d[r-from] = float(q[n] - hist_dot(t, trans.ptr<float>(r), n));
+                return;
+            case HISTCMP_CHISQR:
+                for (int r=from; r<to; r++)
+                    d[r-from] = hist_chi(q, t, features.ptr<float>(r), n);
+                return;
+            case HISTCMP_INTERSECT:
+                for (int r=from; r<to; r++)
+                    d[r-from] = hist_min(q, features.ptr<float>(r), n);
+                return;
+        }
+        ClassifierNearestFloat::distanceRow(pq(Rect(0, 0, n, 1)), from, to, d);
+    }
+
+    virtual void distanceRow(const Mat &query, int from, int to, float *d) const
+    {
+        distancePrepared(prepareQuery(query), from, to, d);
+    }
+
+    // HnswSpace, the query comes from prepareQuery()
+    virtual float dist(const Mat &query, int id) const
+    {
+        float d;
+        distancePrepared(query, id, id+1, &d);
+        return d;
     }
 };
 
@@ -141,6 +949,12 @@ struct ClassifierHist : public ClassifierNearestFloat
 //
 struct ClassifierCosine : public ClassifierNearest
 {
+    ClassifierCosine(bool approx=false, int M=16, int efc=200, int ef=64)
+        : ClassifierNearest(NORM_L2, approx, M, efc, ef)
+    {
+        dense = DENSE_COS;
+    }
+
     static double cosdistance(const cv::Mat &testFeature, const cv::Mat &trainFeature)
     {
         double a = trainFeature.dot(testFeature);
@@ -156,6 +970,285 @@ struct ClassifierCosine : public ClassifierNearest
 };
 
 
+//
+// Norouzi, Punjani, Fleet: "Fast Exact Search in Hamming Space with Multi-Index Hashing"
+//
+//   the codes get cut into m substrings of 16 bits, each one is the key into its own table.
+//   if |q-x| <= m*(r+1)-1, then at least one substring of x is within r bits of q's,
+//   so probing all tables up to radius r finds every row that close, and nothing else is missed.
+//
+// the tables are sorted lists (counting sort), start[key] .. start[key+1] are the row ids.
+//   codes with an odd byte count get an 8 bit last table.
+//   beyond MAX_TABLES (1024 bits), the probes would cost more than a popcount scan, no index then.
+//
+struct HammingIndex
+{
+    enum { BITS=16, BUCKETS=1<<16, MAX_TABLES=64 };
+
+    int bytes;
+    int rows;  // the indexed rows [0..rows), later ones get scanned
+    vector< vector<int> > start, ids;
+
+    HammingIndex() : bytes(0), rows(0) {}
+
+    int tables() const { return int(start.size()); }
+    int bits(int t) const { return (2*t+1 < bytes) ? BITS : 8; }
+
+    inline unsigned key(const uchar *p, int t) const
+    {
+        int o = 2*t;
+        return (o+1 < bytes) ? unsigned(p[o]) | (unsigned(p[o+1]) << 8) : unsigned(p[o]);
+    }
+
+    void clear()
+    {
+        start.clear();
+        ids.clear();
+        bytes = rows = 0;
+    }
+
+    struct Builder : public ParallelLoopBody
+    {
+        HammingIndex &mih;
+        const Gallery &codes;
+
+        Builder(HammingIndex &mih, const Gallery &codes) : mih(mih), codes(codes) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int t=range.start; t<range.end; t++)
+            {
+                vector<int> &st = mih.start[t], &id = mih.ids[t];
+                st.assign(BUCKETS+1, 0);
+                id.resize(mih.rows);
+                vector<unsigned> keys(mih.rows);
+                for (int r=0; r<mih.rows; r++)
+                {
+                    keys[r] = mih.key(codes.ptr<uchar>(r), t);
+                    st[keys[r]+1] ++;
+                }
+                for (int b=0; b<BUCKETS; b++)
+                    st[b+1] += st[b];
+                vector<int> fill(st.begin(), st.end()-1);
+                for (int r=0; r<mih.rows; r++)
+                    id[fill[keys[r]]++] = r;
+            }
+        }
+    };
+
+    void build(const Gallery &codes)
+    {
+        clear();
+        if (codes.empty() || codes.type() != CV_8U)
+            return;
+        int m = (codes.cols() + 1) / 2;
+        if (m > MAX_TABLES)
+            return;
+        bytes = codes.cols();
+        rows = codes.rows();
+        start.resize(m);
+        ids.resize(m);
+        parallel_for_(Range(0, m), Builder(*this, codes));
+    }
+
+    // the row ids in a bucket
+    inline const int *bucket(int t, unsigned k, int &n) const
+    {
+        const vector<int> &st = start[t];
+        n = st[k+1] - st[k];
+        return &ids[t][0] + st[k];
+    }
+};
+
+
+//
+// binary descriptors (LATCH, ORB, ..), packed bytes, compared bitwise.
+//   the gallery rows get scanned with popcount, or looked up in a multi-index hash, if they are short enough.
+//
+struct ClassifierHamming : public ClassifierNearest
+{
+    enum { MIN_REBUILD=1024 }; // unindexed rows, before the tables get rebuilt
+
+    HammingIndex mih;
+
+    ClassifierHamming()
+        : ClassifierNearest(NORM_HAMMING)
+    {}
+
+    // a single row of bytes
+    static Mat code(const Mat &m)
+    {
+        Mat c = codes(m.reshape(1, 1));
+        return c.isContinuous() ? c : c.clone();
+    }
+
+    // float copies of the bytes get packed back
+    static Mat codes(const Mat &m)
+    {
+        if (m.type() == CV_8U)
+            return m;
+        Mat c;
+        m.convertTo(c, CV_8U);
+        return c;
+    }
+
+    // ClassifierNearest
+    virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
+    {
+        Mat a = code(testFeature), b = code(trainFeature);
+        return hamming(a.ptr(), b.ptr(), a.cols);
+    }
+
+    virtual void distanceRow(const Mat &query, int from, int to, float *d) const
+    {
+        Mat q = code(query);
+        for (int r=from; r<to; r++)
+            d[r-from] = float(hamming(q.ptr(), features.ptr<uchar>(r), q.cols));
+    }
+
+    virtual void prepare(int from=0)
+    {
+        if (from == 0 && !features.empty() && features.type() != CV_8U)
+            features = Gallery(codes(features.contiguous()));
+        int tail = features.rows() - mih.rows;
+        if (from == 0 || tail > std::max(int(MIN_REBUILD), mih.rows / 8))
+            mih.build(features);
+    }
+
+    inline void consider(const uchar *q, int r, TopK &best) const
+    {
+        if (labels.at<int>(r) >= 0)
+            best.push(float(hamming(q, features.ptr<uchar>(r), features.cols())), r);
+    }
+
+    static double choose(int n, int k)
+    {
+        double c = 1;
+        for (int i=0; i<k; i++)
+            c = c * (n - i) / (i + 1);
+        return c;
+    }
+
+    //
+    // exact k nearest: probe the tables with growing radius, until the k-th best is closer,
+    //   than anything left unseen can be. if the next radius needs more probes,
+    //   than there are rows left, the rest gets scanned instead.
+    //
+    void search(const uchar *q, int k, TopK &best) const
+    {
+        for (int r=mih.rows; r<features.rows(); r++)
+            consider(q, r, best);
+
+        int m = mih.tables();
+        int unseen = mih.rows;
+        unordered_set<int> seen;
+        for (int radius=0; radius<=HammingIndex::BITS && unseen>0; radius++)
+        {
+            double probes = 0;
+            for (int t=0; t<m; t++)
+                probes += choose(mih.bits(t), radius);
+            if (probes > unseen)
+                break;
+
+            for (int t=0; t<m; t++)
+            {
+                int b = mih.bits(t);
+                if (radius > b)
+                    continue;
+                unsigned key = mih.key(q, t);
+                // all masks with radius bits set, in increasing order (gosper's hack)
+                for (unsigned mask=(1u<<radius)-1; mask<(1u<<b); )
+                {
+                    int n;
+                    const int *id = mih.bucket(t, key ^ mask, n);
+                    for (int i=0; i<n; i++)
+                    {
+                        if (seen.insert(id[i]).second)
+                        {
+                            unseen --;
+                            consider(q, id[i], best);
+                        }
+                    }
+                    if (mask == 0)
+                        break;
+                    unsigned c = mask & (0u - mask), s = mask + c;
+                    mask = (((s ^ mask) >> 2) / c) | s;
+                }
+            }
+            if (best.dist.size() == best.k && best.dist.back() <= m * (radius+1) - 1)
+                return;
+        }
+        if (unseen == 0)
+            return;
+        for (int r=0; r<mih.rows; r++)
+            if (! seen.count(r))
+                consider(q, r, best);
+    }
+
+    // TextureFeature::Classifier
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        Mat q = code(testFeature);
+        TopK best(1);
+        if (! features.empty())
+            search(q.ptr(), 1, best);
+        int id = best.id.empty() ? -1 : best.id[0];
+        results.push_back(float(id>-1 ? labels.at<int>(id) : -1));
+        results.push_back(float(best.dist.empty() ? DBL_MAX : best.dist[0]));
+        results.push_back(float(id));
+        return 3;
+    }
+
+    struct Searcher : public ParallelLoopBody
+    {
+        const ClassifierHamming &cls;
+        const Mat &queries;
+        int k;
+        Mat &results;
+
+        Searcher(const ClassifierHamming &cls, const Mat &queries, int k, Mat &results)
+            : cls(cls), queries(queries), k(k), results(results)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+            {
+                TopK best(k);
+                Mat q = code(queries.row(i));
+                cls.search(q.ptr(), k, best);
+                float *r = results.ptr<float>(i);
+                for (size_t j=0; j<best.id.size(); j++)
+                {
+                    r[3*j]   = float(cls.labels.at<int>(best.id[j]));
+                    r[3*j+1] = best.dist[j];
+                    r[3*j+2] = float(best.id[j]);
+                }
+            }
+        }
+    };
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        Mat q = codes(queries);
+        results = Mat(q.rows, 3*k, CV_32F, Scalar(-1));
+        if (! features.empty())
+            parallel_for_(Range(0, q.rows), Searcher(*this, q, k, results));
+        return results.rows;
+    }
+
+    virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
+    {
+        return ClassifierNearest::train(codes(trainFeatures), trainLabels);
+    }
+
+    virtual int update(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
+    {
+        return ClassifierNearest::update(codes(trainFeatures), trainLabels);
+    }
+};
+
+
 static int unique(const Mat &labels, set<int> &classes)
 {
     for (size_t i=0; i<labels.total(); ++i)
@@ -167,359 +1260,2570 @@ static int unique(const Mat &labels, set<int> &classes)
 // outsourced to svmkernel.cpp
 extern Ptr<ml::SVM::Kernel> customKernel(int id);
 
+
 //
-// single svm, multi class.
+// one-vs-one voting, like opencv's svm: pair p=(i<j) votes for i, if its decision value is > 0
 //
-struct ClassifierSVM : public TextureFeature::Classifier
+static int vote(const Mat_<int> &classes, const double *dec)
 {
-    Ptr<ml::SVM> svm;
-    Ptr<ml::SVM::Kernel> krnl;
+    int C = classes.rows;
+    AutoBuffer<int> buf(C);
+    int *votes = buf;
+    std::fill(votes, votes+C, 0);
+    for (int i=0, p=0; i<C; i++)
+        for (int j=i+1; j<C; j++, p++)
+            votes[dec[p] > 0 ? i : j]++;
+    int best = 0;
+    for (int i=1; i<C; i++)
+        if (votes[i] > votes[best])
+            best = i;
+    return classes(best);
+}
+
+
+//
+// Maji, Berg, Malik: "Classification using Intersection Kernel Support Vector Machines is Efficient"
+//
+//   h(x) = sum_k alpha_k sum_d min(x_d, s_kd) = sum_d h_d(x_d), and each h_d is piecewise linear:
+//   h_d(t) = sum(alpha_k * s_kd, s_kd <= t) + t * sum(alpha_k, s_kd > t)
+//   with the support vector values sorted per dimension, that's a binary search per dimension,
+//   or (bins > 0) a lookup into a table of the function, linearly interpolated.
+//
+// the voting is the same as in opencv's one-vs-one svm.
+//
+struct IntersectionSvm
+{
+    int bins;
+    Mat_<int> classes;  // sorted, like the svm's
+    Mat rho;            // per pair (i<j)
+    vector<Mat> vals;   // per pair: d x m, the sorted support vector values
+    vector<Mat> below;  // per pair: d x (m+1), sum(alpha * s) of the first i values
+    vector<Mat> above;  // per pair: d x (m+1), sum(alpha) of the values from i on
+    vector<Mat> table;  // per pair: d x (bins+1)
+    vector<Mat> ends;   // per pair: d x 4, lo, step, the slope below lo, the value above hi
+
+    IntersectionSvm(int bins=0) : bins(bins) {}
 
-    ClassifierSVM(int ktype=ml::SVM::POLY, double degree = 0.5,double gamma = 0.8,double coef0 = 0,double C = 0.99, double nu = 0.002, double p = 0.5)
+    bool empty() const { return rho.empty(); }
+
+    void clear()
     {
-        svm = ml::SVM::create();
-        svm->setType(ml::SVM::NU_SVC);
-        if (ktype<0)
+        classes.release();
+        rho.release();
+        vals.clear();
+        below.clear();
+        above.clear();
+        table.clear();
+        ends.clear();
+    }
+
+    struct Builder : public ParallelLoopBody
+    {
+        IntersectionSvm &iksvm;
+        const ml::SVM &svm;
+        const Mat &sv;
+
+        Builder(IntersectionSvm &iksvm, const ml::SVM &svm, const Mat &sv) : iksvm(iksvm), svm(svm), sv(sv) {}
+
+        virtual void operator()(const Range &range) const
         {
-            krnl = customKernel(ktype);
-            ktype=-1;
-            svm->setCustomKernel(krnl);
+            for (int p=range.start; p<range.end; p++)
+                iksvm.buildPair(svm, sv, p);
         }
-        svm->setKernel(ktype); //SVM::LINEAR;
-        svm->setDegree(degree);
-        svm->setGamma(gamma);
-        svm->setCoef0(coef0);
-        svm->setNu(nu);
-        svm->setP(p);
-        svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
-        svm->setC(C);
+    };
+
+    void buildPair(const ml::SVM &svm, const Mat &sv, int p)
+    {
+        Mat alpha, idx;
+        rho.at<double>(p) = svm.getDecisionFunction(p, alpha, idx);
+        alpha.convertTo(alpha, CV_64F);
+
+        int m = int(idx.total()), d = sv.cols;
+        Mat V(d, m, CV_32F), A(d, m+1, CV_32F), B(d, m+1, CV_32F);
+        vector< pair<float,double> > col(m);
+        for (int j=0; j<d; j++)
+        {
+            for (int k=0; k<m; k++)
+                col[k] = make_pair(sv.at<float>(idx.at<int>(k), j), alpha.at<double>(k));
+            std::sort(col.begin(), col.end());
+
+            double a = 0, b = 0;
+            A.at<float>(j, 0) = 0;
+            B.at<float>(j, m) = 0;
+            for (int k=0; k<m; k++)
+            {
+                V.at<float>(j, k) = col[k].first;
+                a += col[k].second * col[k].first;
+                A.at<float>(j, k+1) = float(a);
+                b += col[m-1-k].second;
+                B.at<float>(j, m-1-k) = float(b);
+            }
+        }
+        if (bins <= 0)
+        {
+            vals[p] = V;
+            below[p] = A;
+            above[p] = B;
+            return;
+        }
+
+        Mat T(d, bins+1, CV_32F), E(d, 4, CV_32F);
+        for (int j=0; j<d; j++)
+        {
+            float lo = m ? V.at<float>(j, 0) : 0, hi = m ? V.at<float>(j, m-1) : 0;
+            float step = std::max((hi - lo) / bins, FLT_MIN);
+            for (int i=0; i<=bins; i++)
+                T.at<float>(j, i) = exact(V.ptr<float>(j), A.ptr<float>(j), B.ptr<float>(j), m, lo + i * step);
+            E.at<float>(j, 0) = lo;
+            E.at<float>(j, 1) = step;
+            E.at<float>(j, 2) = B.at<float>(j, 0);
+            E.at<float>(j, 3) = A.at<float>(j, m);
+        }
+        table[p] = T;
+        ends[p] = E;
     }
 
-    virtual int train(const Mat &src, const Mat &labels)
+    void build(const ml::SVM &svm, const Mat &labels)
     {
-        Mat trainData = tofloat(src.reshape(1,labels.rows));
+        clear();
+        set<int> c;
+        TextureFeatureImpl::unique(labels, c);
+        for (set<int>::iterator it=c.begin(); it!=c.end(); ++it)
+            classes.push_back(*it);
+
+        int P = classes.rows * (classes.rows - 1) / 2;
+        rho = Mat(P, 1, CV_64F);
+        vals.resize(P);
+        below.resize(P);
+        above.resize(P);
+        table.resize(P);
+        ends.resize(P);
+        Mat sv = tofloat(svm.getSupportVectors());
+        parallel_for_(Range(0, P), Builder(*this, svm, sv));
+        if (bins > 0) // not needed any more
+        {
+            vals.clear();
+            below.clear();
+            above.clear();
+        }
+    }
 
-        svm->clear();
-        bool ok = svm->train(trainData , ml::ROW_SAMPLE , Mat(labels));
-        // damn thing fails silently, if nu was not acceptable
-        CV_Assert(ok&&"please check the input params(nu)");
-        return trainData.rows;
+    static inline float exact(const float *v, const float *a, const float *b, int m, float t)
+    {
+        int i = int(std::upper_bound(v, v+m, t) - v);
+        return a[i] + t * b[i];
     }
 
-    virtual int predict(const Mat &src, Mat &res) const
+    double decision(int p, const float *x) const
     {
-        svm->predict(tofloat(src), res);
-        return res.rows;
+        double s = -rho.at<double>(p);
+        if (bins <= 0)
+        {
+            const Mat &V = vals[p], &A = below[p], &B = above[p];
+            for (int j=0; j<V.rows; j++)
+                s += exact(V.ptr<float>(j), A.ptr<float>(j), B.ptr<float>(j), V.cols, x[j]);
+            return s;
+        }
+        const Mat &T = table[p], &E = ends[p];
+        for (int j=0; j<T.rows; j++)
+        {
+            const float *e = E.ptr<float>(j);
+            float t = x[j], u = (t - e[0]) / e[1];
+            if (u <= 0)
+                s += t * e[2];
+            else if (u >= bins)
+                s += e[3];
+            else
+            {
+                int i = int(u);
+                float f = u - i;
+                const float *tb = T.ptr<float>(j);
+                s += tb[i] + f * (tb[i+1] - tb[i]);
+            }
+        }
+        return s;
     }
 
-    // Serialize
-    virtual bool save(FileStorage &fs) const
+    int predict(const float *x) const
     {
-        if(!fs.isOpened()) return false;
-        svm->write(fs);
-        return true;
+        vector<double> dec(rho.rows);
+        for (int p=0; p<rho.rows; p++)
+            dec[p] = decision(p, x);
+        return vote(classes, dec.empty() ? 0 : &dec[0]);
     }
 
-    virtual bool load(const FileStorage &fs)
+    struct Predictor : public ParallelLoopBody
     {
-        if(!fs.isOpened()) return false;
-        svm->read(fs.getFirstTopLevelNode());
-        return true;
+        const IntersectionSvm &iksvm;
+        const Mat &queries;
+        Mat &res;
+
+        Predictor(const IntersectionSvm &iksvm, const Mat &queries, Mat &res) : iksvm(iksvm), queries(queries), res(res) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int r=range.start; r<range.end; r++)
+                res.at<float>(r) = float(iksvm.predict(queries.ptr<float>(r)));
+        }
+    };
+
+    // one label per row, like svm->predict()
+    void predict(const Mat &queries, Mat &res) const
+    {
+        Mat q = tofloat(queries);
+        if (! q.isContinuous())
+            q = q.clone();
+        res.create(q.rows, 1, CV_32F);
+        parallel_for_(Range(0, q.rows), Predictor(*this, q, res));
     }
-};
 
+    void save(Archive &ar) const
+    {
+        ar << "iksvm_bins" << bins;
+        ar << "iksvm_classes" << Mat(classes);
+        ar << "iksvm_rho" << rho;
+        if (bins <= 0)
+        {
+            ar << "iksvm_vals" << vals;
+            ar << "iksvm_below" << below;
+            ar << "iksvm_above" << above;
+        }
+        else
+        {
+            ar << "iksvm_table" << table;
+            ar << "iksvm_ends" << ends;
+        }
+    }
 
+    bool load(const Archive &ar)
+    {
+        clear();
+        if (ar["iksvm_rho"].empty())
+            return false;
+        Mat c;
+        ar["iksvm_bins"] >> bins;
+        ar["iksvm_classes"] >> c;
+        classes = c;
+        ar["iksvm_rho"] >> rho;
+        if (bins <= 0)
+        {
+            ar["iksvm_vals"] >> vals;
+            ar["iksvm_below"] >> below;
+            ar["iksvm_above"] >> above;
+        }
+        else
+        {
+            ar["iksvm_table"] >> table;
+            ar["iksvm_ends"] >> ends;
+        }
+        return true;
+    }
+};
 
 //
-// single class(one vs. all), multi svm approach
+// a linear svm collapsed: every one-vs-one pair becomes a single weight vector w = sum(alpha_k * sv_k),
+//   so all decision values of a batch come from a single gemm, X * W' - rho.
 //
-struct ClassifierSvmMulti : public TextureFeature::Classifier
+struct LinearSvm
 {
-    vector< Ptr<ml::SVM> > svms;
+    Mat_<int> classes; // sorted, like the svm's
+    Mat W;             // pairs x d
+    Mat rho;           // 1 x pairs
 
-    virtual int train(const Mat &src, const Mat &labels)
+    bool empty() const { return W.empty(); }
+
+    void clear()
     {
-        svms.clear();
+        classes.release();
+        W.release();
+        rho.release();
+    }
 
-        Mat trainData = tofloat(src.reshape(1,labels.rows));
-        //
-        // train one svm per class:
-        //
-        set<int> classes;
-        unique(labels,classes);
-
-        for (set<int>::iterator it=classes.begin(); it != classes.end(); ++it)
-        {
-            Ptr<ml::SVM> svm = ml::SVM::create();
-            svm->setType(ml::SVM::NU_SVC);
-            svm->setKernel(ml::SVM::LINEAR);
-            svm->setDegree(0.8);
-            svm->setGamma(1.0);
-            svm->setCoef0(0.0);
-            svm->setNu(0.05);
-            svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
-
-            Mat slabels; // you against all others, that's the only difference.
-            for ( size_t j=0; j<labels.total(); ++j)
-                slabels.push_back( (*it == labels.at<int>(j)) ? 1 : -1 );
-            bool ok = svm->train(trainData , ml::ROW_SAMPLE , slabels); // same data, different labels.
-            CV_Assert(ok);
-            svms.push_back(svm);
+    void build(const ml::SVM &svm, const Mat &labels)
+    {
+        clear();
+        set<int> c;
+        TextureFeatureImpl::unique(labels, c);
+        for (set<int>::iterator it=c.begin(); it!=c.end(); ++it)
+            classes.push_back(*it);
+
+        int P = classes.rows * (classes.rows - 1) / 2;
+        Mat sv;
+        svm.getSupportVectors().convertTo(sv, CV_64F);
+        W = Mat(P, sv.cols, CV_32F);
+        rho = Mat(1, P, CV_64F);
+        for (int p=0; p<P; p++)
+        {
+            Mat alpha, idx;
+            rho.at<double>(p) = svm.getDecisionFunction(p, alpha, idx);
+            alpha.convertTo(alpha, CV_64F);
+            Mat w = Mat::zeros(1, sv.cols, CV_64F);
+            for (size_t k=0; k<idx.total(); k++)
+                w += sv.row(idx.at<int>(int(k))) * alpha.at<double>(int(k));
+            w.convertTo(W.row(p), CV_32F);
         }
-        return trainData.rows;
     }
 
+    // the decision values, queries.rows x pairs, double
+    void decision(const Mat &queries, Mat &dec) const
+    {
+        gemm(tofloat(queries), W, 1.0, noArray(), 0.0, dec, GEMM_2_T);
+        dec.convertTo(dec, CV_64F);
+        dec -= repeat(rho, dec.rows, 1);
+    }
 
-    virtual int predict(const Mat &src, Mat &res) const
+    // one label per row, like svm->predict()
+    void predict(const Mat &queries, Mat &res) const
     {
-        Mat query = tofloat(src);
-        //
-        // predict per-class, return first positive result
-        // hrmm, this assumes, the labels are ordered [0..N]
-        //
-        float m = 100.0f;
-        float mi = 0.0f;
-        for (size_t j=0; j<svms.size(); ++j)
-        {
-            Mat r;
-            svms[j]->predict(query, r);
-            float p = r.at<float>(0);
-            if (p > 0)
-            {
-                m = p;
-                mi = float(j);
-                break;
-            }
-        }
-        res = (Mat_<float>(1,2) << mi, m);
-        return res.rows;
+        Mat dec;
+        decision(queries, dec);
+        res.create(dec.rows, 1, CV_32F);
+        for (int r=0; r<dec.rows; r++)
+            res.at<float>(r) = float(vote(classes, dec.ptr<double>(r)));
     }
-};
 
-struct PPCA
-{
+    void save(Archive &ar) const
+    {
+        ar << "linsvm_classes" << Mat(classes);
+        ar << "linsvm_W" << W;
+        ar << "linsvm_rho" << rho;
+    }
+
+    bool load(const Archive &ar)
+    {
+        clear();
+        if (ar["linsvm_W"].empty())
+            return false;
+        Mat c;
+        ar["linsvm_classes"] >> c;
+        classes = c;
+        ar["linsvm_W"] >> W;
+        ar["linsvm_rho"] >> rho;
+        return true;
+    }
 };
 
+
 //
+// Burges, Schoelkopf: "Improving the Accuracy and Speed of Support Vector Machines"
 //
-// 'Eigenfaces'
+//   reduced set: every decision function sum(alpha_k * K(s_k, x)) gets replaced by
+//   sum(beta_j * K(z_j, x)), with a budget of (at most) B synthetic vectors per pair.
+//   the z_j are the kmeans centers of the pair's support vectors, and beta minimizes
+//   the distance of both in feature space: Kzz * beta = Kzs * alpha.
 //
-struct ClassifierPCA : public ClassifierNearestFloat
+// the relative (feature space) error of each pair is kept in errors.
+// pairs within budget keep their support vectors, those are shared between the pairs,
+//   so Z holds each one once, and its kernel value gets computed once per query.
+//
+struct ReducedSvm
 {
-    Mat eigenvectors;
-    Mat mean;
-    int num_components;
+    int kernel;                      // the svm's kernel type
+    double gamma, coef0, degree;
+    Ptr<ml::SVM::Kernel> custom;     // for ml::SVM::CUSTOM
+    Mat_<int> classes;               // sorted, like the svm's
+    Mat Z;                           // the vectors, each one only once (shared support vectors, or centers)
+    Mat_<int> index;                 // per term: its row in Z
+    Mat beta;                        // per term: its weight
+    Mat_<int> ofs;                   // pair p owns the terms [ofs(p)..ofs(p+1)), like opencv's DecisionFunction
+    Mat rho;                         // per pair
+    Mat errors;                      // per pair
+
+    ReducedSvm() : kernel(ml::SVM::LINEAR), gamma(1), coef0(0), degree(1) {}
+
+    bool empty() const { return Z.empty(); }
+    double error() const { return errors.empty() ? 0 : mean(errors)[0]; }
+
+    void clear()
+    {
+        classes.release();
+        Z.release();
+        index.release();
+        beta.release();
+        ofs.release();
+        rho.release();
+        errors.release();
+    }
 
-    ClassifierPCA(int num_components=0)
-        : num_components(num_components)
-    {}
+    // K(z_j, x) for all rows of z, same as opencv's svm
+    void kernelRow(const Mat &z, const float *x, float *out) const
+    {
+        if (kernel == ml::SVM::CUSTOM)
+        {
+            custom->calc(z.rows, z.cols, z.ptr<float>(), x, out);
+            return;
+        }
+        for (int j=0; j<z.rows; j++)
+        {
+            const float *a = z.ptr<float>(j);
+            double v = 0;
+            switch(kernel)
+            {
+                case ml::SVM::LINEAR:  v = hist_dot(a, x, z.cols); break;
+                case ml::SVM::POLY:    v = std::pow(gamma * hist_dot(a, x, z.cols) + coef0, degree); break;
+                case ml::SVM::SIGMOID: v = std::tanh(gamma * hist_dot(a, x, z.cols) + coef0); break;
+                case ml::SVM::INTER:   v = hist_min(a, x, z.cols); break;
+                case ml::SVM::RBF:
+                {
+                    double d = 0;
+                    for (int k=0; k<z.cols; k++)
+                        d += (a[k] - x[k]) * (a[k] - x[k]);
+                    v = std::exp(-gamma * d);
+                    break;
+                }
+                case ml::SVM::CHI2:
+                {
+                    double d = 0;
+                    for (int k=0; k<z.cols; k++)
+                    {
+                        double s = a[k] + x[k];
+                        if (s > FLT_EPSILON)
+                            d += (a[k] - x[k]) * (a[k] - x[k]) / s;
+                    }
+                    v = std::exp(-gamma * d);
+                    break;
+                }
+            }
+            out[j] = float(v);
+        }
+    }
 
-    inline
-    Mat project(const Mat &src) const
+    // K(a_i, b_j), a.rows x b.rows
+    Mat gram(const Mat &a, const Mat &b) const
     {
-        return LDA::subspaceProject(eigenvectors, mean, src);
+        Mat k(b.rows, a.rows, CV_32F), k64;
+        for (int j=0; j<b.rows; j++)
+            kernelRow(a, b.ptr<float>(j), k.ptr<float>(j));
+        Mat(k.t()).convertTo(k64, CV_64F);
+        return k64;
     }
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    struct Reducer : public ParallelLoopBody
     {
-        if((num_components <= 0) || (num_components > trainData.rows))
-            num_components = trainData.rows;
+        const ReducedSvm &rsvm;
+        const ml::SVM &svm;
+        const Mat &sv;
+        int budget;
+        vector<Mat> &z, &b, &ids; // per pair: new vectors (reduced), or the ids of the support vectors
+        Mat &rho, &errors;
+
+        Reducer(const ReducedSvm &rsvm, const ml::SVM &svm, const Mat &sv, int budget, vector<Mat> &z, vector<Mat> &b, vector<Mat> &ids, Mat &rho, Mat &errors)
+            : rsvm(rsvm), svm(svm), sv(sv), budget(budget), z(z), b(b), ids(ids), rho(rho), errors(errors)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int p=range.start; p<range.end; p++)
+            {
+                Mat alpha, idx, S;
+                rho.at<double>(p) = svm.getDecisionFunction(p, alpha, idx);
+                alpha.convertTo(alpha, CV_64F);
+                alpha = alpha.reshape(1, int(alpha.total()));
+                if (int(idx.total()) <= budget)
+                {
+                    ids[p] = idx.reshape(1, int(idx.total()));
+                    b[p] = alpha;
+                    errors.at<double>(p) = 0;
+                    continue;
+                }
+                for (size_t k=0; k<idx.total(); k++)
+                    S.push_back(sv.row(idx.at<int>(int(k))));
+
+                Mat lab, centers;
+                kmeans(S, budget, lab, TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 1e-4), 1, KMEANS_PP_CENTERS, centers);
+
+                Mat Kzz = rsvm.gram(centers, centers);
+                Mat rhs = rsvm.gram(centers, S) * alpha;
+                Kzz += Mat::eye(Kzz.size(), CV_64F) * (trace(Kzz)[0] / Kzz.rows * 1e-8); // keep it regular
+                Mat be;
+                cv::solve(Kzz, rhs, be, DECOMP_SVD);
+
+                // |psi - psi'|^2 / |psi|^2
+                double full = Mat(alpha.t() * rsvm.gram(S, S) * alpha).at<double>(0);
+                double diff = full - 2 * be.dot(rhs) + Mat(be.t() * Kzz * be).at<double>(0);
+                errors.at<double>(p) = std::max(diff, 0.0) / std::max(std::abs(full), DBL_EPSILON);
+                z[p] = centers;
+                b[p] = be;
+            }
+        }
+    };
 
-        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, num_components);
+    void build(const ml::SVM &svm, const Ptr<ml::SVM::Kernel> &krnl, const Mat &labels, int budget)
+    {
+        clear();
+        kernel = svm.getKernelType();
+        gamma  = svm.getGamma();
+        coef0  = svm.getCoef0();
+        degree = svm.getDegree();
+        custom = krnl;
+
+        set<int> c;
+        TextureFeatureImpl::unique(labels, c);
+        for (set<int>::iterator it=c.begin(); it!=c.end(); ++it)
+            classes.push_back(*it);
+
+        int P = classes.rows * (classes.rows - 1) / 2;
+        vector<Mat> z(P), b(P), ids(P);
+        rho = Mat(P, 1, CV_64F);
+        errors = Mat(P, 1, CV_64F);
+        Mat sv = tofloat(svm.getSupportVectors());
+        parallel_for_(Range(0, P), Reducer(*this, svm, sv, budget, z, b, ids, rho, errors));
+
+        // support vectors shared by several pairs go into Z once, unused ones not at all
+        vector<int> row(sv.rows, -1);
+        ofs.push_back(0);
+        for (int p=0; p<P; p++)
+        {
+            for (int k=0; k<ids[p].rows; k++)
+            {
+                int i = ids[p].at<int>(k);
+                if (row[i] < 0)
+                {
+                    row[i] = Z.rows;
+                    Z.push_back(sv.row(i));
+                }
+                index.push_back(row[i]);
+            }
+            for (int k=0; k<z[p].rows; k++)
+            {
+                index.push_back(Z.rows);
+                Z.push_back(z[p].row(k));
+            }
+            beta.push_back(b[p]);
+            ofs.push_back(index.rows);
+        }
+    }
+
+    struct Decider : public ParallelLoopBody
+    {
+        const ReducedSvm &rsvm;
+        const Mat &queries;
+        Mat &dec;
+
+        Decider(const ReducedSvm &rsvm, const Mat &queries, Mat &dec) : rsvm(rsvm), queries(queries), dec(dec) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            vector<float> k(rsvm.Z.rows);
+            for (int r=range.start; r<range.end; r++)
+            {
+                rsvm.kernelRow(rsvm.Z, queries.ptr<float>(r), &k[0]);
+                for (int p=0; p<rsvm.rho.rows; p++)
+                {
+                    double s = -rsvm.rho.at<double>(p);
+                    for (int j=rsvm.ofs(p); j<rsvm.ofs(p+1); j++)
+                        s += rsvm.beta.at<double>(j) * k[rsvm.index(j)];
+                    dec.at<double>(r, p) = s;
+                }
+            }
+        }
+    };
+
+    // the decision values, queries.rows x pairs, double
+    void decision(const Mat &queries, Mat &dec) const
+    {
+        Mat q = tofloat(queries);
+        if (! q.isContinuous())
+            q = q.clone();
+        dec.create(q.rows, rho.rows, CV_64F);
+        parallel_for_(Range(0, q.rows), Decider(*this, q, dec));
+    }
+
+    // one label per row, like svm->predict()
+    void predict(const Mat &queries, Mat &res) const
+    {
+        Mat dec;
+        decision(queries, dec);
+        res.create(dec.rows, 1, CV_32F);
+        for (int r=0; r<dec.rows; r++)
+            res.at<float>(r) = float(vote(classes, dec.ptr<double>(r)));
+    }
+
+    void save(Archive &ar) const
+    {
+        ar << "rsvm_kernel" << kernel;
+        ar << "rsvm_gamma" << gamma;
+        ar << "rsvm_coef0" << coef0;
+        ar << "rsvm_degree" << degree;
+        ar << "rsvm_classes" << Mat(classes);
+        ar << "rsvm_Z" << Z;
+        ar << "rsvm_index" << Mat(index);
+        ar << "rsvm_beta" << beta;
+        ar << "rsvm_ofs" << Mat(ofs);
+        ar << "rsvm_rho" << rho;
+        ar << "rsvm_errors" << errors;
+    }
+
+    bool load(const Archive &ar, const Ptr<ml::SVM::Kernel> &krnl)
+    {
+        clear();
+        if (ar["rsvm_Z"].empty())
+            return false;
+        Mat c, o, i;
+        ar["rsvm_kernel"] >> kernel;
+        ar["rsvm_gamma"] >> gamma;
+        ar["rsvm_coef0"] >> coef0;
+        ar["rsvm_degree"] >> degree;
+        ar["rsvm_classes"] >> c;
+        ar["rsvm_Z"] >> Z;
+        ar["rsvm_index"] >> i;
+        ar["rsvm_beta"] >> beta;
+        ar["rsvm_ofs"] >> o;
+        ar["rsvm_rho"] >> rho;
+        ar["rsvm_errors"] >> errors;
+        classes = c;
+        ofs = o;
+        index = i;
+        if (index.empty()) // older archives: one row of Z per term
+            for (int j=0; j<Z.rows; j++)
+                index.push_back(j);
+        custom = krnl;
+        return true;
+    }
+};
+
+
+//
+// opencv's own models go into the archive as their FileStorage text,
+//   wrapped into a map, so read() gets the same node, write() started from.
+//
+static void saveModel(Archive &ar, const String &key, const Algorithm &model)
+{
+    FileStorage fs(".yml", FileStorage::WRITE + FileStorage::MEMORY);
+    fs << "model" << "{";
+    model.write(fs);
+    fs << "}";
+    ar << key << fs.releaseAndGetString();
+}
+
+static bool loadModel(const Archive &ar, const String &key, Algorithm &model)
+{
+    String s;
+    ar[key] >> s;
+    if (s.empty())
+        return false;
+    FileStorage fs(s, FileStorage::READ + FileStorage::MEMORY);
+    model.read(fs["model"]);
+    return true;
+}
+
+
+//
+// single svm, multi class.
+//
+struct ClassifierSVM : public TextureFeature::Classifier
+{
+    Ptr<ml::SVM> svm;
+    Ptr<ml::SVM::Kernel> krnl;
+    int kernel;
+    IntersectionSvm iksvm; // built after training with the intersection kernel (-5)
+    LinearSvm linear;      // built after training with the linear kernel
+    ReducedSvm reduced;    // built after training with any other kernel, if budget > 0
+    int budget;            // reduced set vectors per one-vs-one pair, 0: keep the support vectors
+
+    // bins: intersection kernel lookup table size, 0: binary search in the sorted support vectors
+    ClassifierSVM(int ktype=ml::SVM::POLY, double degree = 0.5,double gamma = 0.8,double coef0 = 0,double C = 0.99, double nu = 0.002, double p = 0.5, int budget = 0, int bins = 0)
+        : kernel(ktype)
+        , iksvm(bins)
+        , budget(budget)
+    {
+        svm = ml::SVM::create();
+        svm->setType(ml::SVM::NU_SVC);
+        if (ktype<0)
+        {
+            krnl = customKernel(ktype);
+            ktype=-1;
+            svm->setCustomKernel(krnl);
+        }
+        svm->setKernel(ktype); //SVM::LINEAR;
+        svm->setDegree(degree);
+        svm->setGamma(gamma);
+        svm->setCoef0(coef0);
+        svm->setNu(nu);
+        svm->setP(p);
+        svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
+        svm->setC(C);
+    }
+
+    virtual int train(const Mat &src, const Mat &labels)
+    {
+        Mat trainData = tofloat(src.reshape(1,labels.rows));
+
+        svm->clear();
+        iksvm.clear();
+        linear.clear();
+        reduced.clear();
+        bool ok = svm->train(trainData , ml::ROW_SAMPLE , Mat(labels));
+        // damn thing fails silently, if nu was not acceptable
+        CV_Assert(ok&&"please check the input params(nu)");
+        if (kernel == ml::SVM::LINEAR)
+            linear.build(*svm, labels);
+        else if (budget > 0)
+            reduced.build(*svm, krnl, labels, budget);
+        else if (kernel == -5)
+            iksvm.build(*svm, labels);
+        else if (krnl) // opencv can't read back custom kernels, so keep all support vectors in a set
+            reduced.build(*svm, krnl, labels, INT_MAX);
+        return trainData.rows;
+    }
+
+    virtual String info() const
+    {
+        if (reduced.empty())
+            return "";
+        return format("%d vectors, reduced set error %.4f", reduced.Z.rows, reduced.error());
+    }
+
+    virtual int predict(const Mat &src, Mat &res) const
+    {
+        if (! iksvm.empty())
+            iksvm.predict(src, res);
+        else if (! linear.empty())
+            linear.predict(src, res);
+        else if (! reduced.empty())
+            reduced.predict(src, res);
+        else
+            svm->predict(tofloat(src), res);
+        return res.rows;
+    }
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        Mat res;
+        if (! iksvm.empty())
+            iksvm.predict(queries, res);
+        else if (! linear.empty())
+            linear.predict(queries, res);
+        else if (! reduced.empty())
+            reduced.predict(queries, res);
+        else
+            svm->predict(tofloat(queries), res); // labels only
+        results = Mat(queries.rows, 3*k, CV_32F, Scalar(-1));
+        res.copyTo(results.col(0));
+        return results.rows;
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        if (! linear.empty()) // the weights replace the support vectors
+        {
+            linear.save(ar);
+            return true;
+        }
+        if (! reduced.empty()) // same for the reduced set
+        {
+            reduced.save(ar);
+            return true;
+        }
+        if (! iksvm.empty())
+        {
+            iksvm.save(ar);
+            return true;
+        }
+        if (! svm->isTrained())
+            return false;
+        saveModel(ar, "svm", *svm);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        if (linear.load(ar))
+            return true;
+        if (reduced.load(ar, krnl))
+            return true;
+        if (iksvm.load(ar))
+            return true;
+        return loadModel(ar, "svm", *svm);
+    }
+};
+
+
+
+//
+// single class(one vs. all), multi svm approach
+//
+struct ClassifierSvmMulti : public TextureFeature::Classifier
+{
+    Mat_<int> classes;
+    Mat W;   // one weight vector per class, the linear svm collapsed
+    Mat rho; // 1 x classes
+
+    //
+    // one class per thread, all of them share the (read-only) training data.
+    //
+    struct Trainer : public ParallelLoopBody
+    {
+        const Mat &data, &labels;
+        ClassifierSvmMulti &multi;
+
+        Trainer(const Mat &data, const Mat &labels, ClassifierSvmMulti &multi) : data(data), labels(labels), multi(multi) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int c=range.start; c<range.end; c++)
+            {
+                Ptr<ml::SVM> svm = ml::SVM::create();
+                svm->setType(ml::SVM::NU_SVC);
+                svm->setKernel(ml::SVM::LINEAR);
+                svm->setDegree(0.8);
+                svm->setGamma(1.0);
+                svm->setCoef0(0.0);
+                svm->setNu(0.05);
+                svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
+
+                Mat slabels; // you against all others, that's the only difference.
+                for ( size_t j=0; j<labels.total(); ++j)
+                    slabels.push_back( (multi.classes(c) == labels.at<int>(int(j))) ? 1 : -1 );
+                bool ok = svm->train(data , ml::ROW_SAMPLE , slabels); // same data, different labels.
+                CV_Assert(ok);
+
+                // the classes are sorted (-1,1), so 'sum > 0' votes against this class:
+                //   score = rho - w * x
+                Mat alpha, idx, sv;
+                multi.rho.at<float>(c) = float(svm->getDecisionFunction(0, alpha, idx));
+                alpha.convertTo(alpha, CV_64F);
+                svm->getSupportVectors().convertTo(sv, CV_64F);
+                Mat w = Mat::zeros(1, sv.cols, CV_64F);
+                for (size_t k=0; k<idx.total(); k++)
+                    w += sv.row(idx.at<int>(int(k))) * alpha.at<double>(int(k));
+                w.convertTo(multi.W.row(c), CV_32F);
+            }
+        }
+    };
+
+    virtual int train(const Mat &src, const Mat &labels)
+    {
+        Mat trainData = tofloat(src.reshape(1,labels.rows));
+        //
+        // train one svm per class:
+        //
+        set<int> cls;
+        unique(labels,cls);
+        classes.release();
+        for (set<int>::iterator it=cls.begin(); it != cls.end(); ++it)
+            classes.push_back(*it);
+
+        W = Mat(classes.rows, trainData.cols, CV_32F);
+        rho = Mat(1, classes.rows, CV_32F);
+        parallel_for_(Range(0, classes.rows), Trainer(trainData, labels, *this));
+        return trainData.rows;
+    }
+
+    // all decision values at once, queries.rows x classes
+    Mat scores(const Mat &queries) const
+    {
+        Mat s;
+        gemm(tofloat(queries), W, -1.0, repeat(rho, queries.rows, 1), 1.0, s, GEMM_2_T);
+        return s;
+    }
+
+    virtual int predict(const Mat &src, Mat &res) const
+    {
+        Mat s = scores(src.reshape(1,1));
+        Point best;
+        double m;
+        minMaxLoc(s, 0, &m, 0, &best);
+        res = (Mat_<float>(1,2) << float(classes(best.x)), float(m));
+        return res.rows;
+    }
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        Mat s = scores(queries);
+        results = Mat(queries.rows, 3*k, CV_32F, Scalar(-1));
+        for (int i=0; i<s.rows; i++)
+        {
+            TopK top(k);
+            for (int c=0; c<s.cols; c++)
+                top.push(-s.at<float>(i, c), c);
+            for (size_t j=0; j<top.id.size(); j++)
+            {
+                results.at<float>(i, 3*j)   = float(classes(top.id[j]));
+                results.at<float>(i, 3*j+1) = top.dist[j];
+            }
+        }
+        return results.rows;
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "classes" << Mat(classes);
+        ar << "W" << W;
+        ar << "rho" << rho;
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        Mat c;
+        ar["classes"] >> c;
+        ar["W"] >> W;
+        ar["rho"] >> rho;
+        classes = c;
+        return ! W.empty();
+    }
+};
+
+
+//
+// Hsieh, Chang, Lin, Keerthi, Sundararajan: "A Dual Coordinate Descent Method for Large-scale Linear SVM"
+// Yu, Huang, Lin: "Dual Coordinate Descent Methods for Logistic Regression and Maximum Entropy Models"
+//
+//   liblinear style, L2 regularized, one-vs-rest, one class per thread (with a bias feature).
+//   mostly-zero rows get stored as csr, the others as float rows.
+//   the dual variables are kept, so update() continues from the last solution (warm start).
+//
+struct ClassifierLinear : public TextureFeature::Classifier
+{
+    enum { L2LOSS_SVM, LOGISTIC };
+
+    int loss;
+    double C;       // penalty
+    double eps;     // stopping tolerance
+    double bias;    // the extra feature, 0: none
+    int maxIter;
+
+    // the training rows, either dense, or csr:
+    bool sparse;
+    Mat dense;             // n x d float
+    vector<float> val;
+    vector<int> col, rowptr;
+    vector<double> qii;    // x_i * x_i
+    int dims;
+
+    Mat_<int> labels;
+    Mat_<int> classes;
+    Mat alpha;             // n x classes, double
+    Mat W;                 // classes x (d+1), the bias weight last
+
+    ClassifierLinear(int loss=L2LOSS_SVM, double C=1.0, double eps=0.1, double bias=1.0, int maxIter=1000)
+        : loss(loss)
+        , C(C)
+        , eps(eps)
+        , bias(bias)
+        , maxIter(maxIter)
+        , sparse(false)
+        , dims(0)
+    {}
+
+    int rows() const { return labels.rows; }
+
+    double dot(int i, const double *w) const
+    {
+        double s = bias * w[dims];
+        if (sparse)
+        {
+            for (int k=rowptr[i]; k<rowptr[i+1]; k++)
+                s += val[k] * w[col[k]];
+            return s;
+        }
+        const float *x = dense.ptr<float>(i);
+        for (int j=0; j<dims; j++)
+            s += x[j] * w[j];
+        return s;
+    }
+
+    // w += a * x_i
+    void axpy(int i, double a, double *w) const
+    {
+        w[dims] += a * bias;
+        if (sparse)
+        {
+            for (int k=rowptr[i]; k<rowptr[i+1]; k++)
+                w[col[k]] += a * val[k];
+            return;
+        }
+        const float *x = dense.ptr<float>(i);
+        for (int j=0; j<dims; j++)
+            w[j] += a * x[j];
+    }
+
+    void append(const Mat &src)
+    {
+        Mat data = tofloat(src.reshape(1, src.rows));
+        if (rowptr.empty())
+        {
+            dims = data.cols;
+            sparse = size_t(countNonZero(data)) < data.total() / 2;
+            rowptr.push_back(0);
+        }
+        CV_Assert(data.cols == dims);
+        for (int i=0; i<data.rows; i++)
+        {
+            const float *x = data.ptr<float>(i);
+            double q = bias * bias;
+            for (int j=0; j<dims; j++)
+            {
+                q += x[j] * x[j];
+                if (sparse && x[j] != 0)
+                {
+                    val.push_back(x[j]);
+                    col.push_back(j);
+                }
+            }
+            qii.push_back(q);
+            rowptr.push_back(int(val.size()));
+        }
+        if (! sparse)
+            dense.push_back(data);
+    }
+
+    // the initial dual variable of a new row
+    double alpha0() const
+    {
+        return (loss == LOGISTIC) ? std::min(0.001 * C, 1e-8) : 0.0;
+    }
+
+    void solveSvm(int c, const vector<int> &y, double *a, double *w) const
+    {
+        double Dii = 0.5 / C; // squared hinge: no upper bound, but a diagonal
+        int n = rows();
+        vector<int> order(n);
+        for (int i=0; i<n; i++) order[i] = i;
+        RNG rng(c + 1);
+        for (int iter=0; iter<maxIter; iter++)
+        {
+            for (int i=0; i<n; i++)
+                std::swap(order[i], order[i + rng.uniform(0, n-i)]);
+
+            double pgmax = -DBL_MAX, pgmin = DBL_MAX;
+            for (int s=0; s<n; s++)
+            {
+                int i = order[s];
+                double G = y[i] * dot(i, w) - 1 + Dii * a[i];
+                double PG = (a[i] == 0) ? std::min(G, 0.0) : G;
+                pgmax = std::max(pgmax, PG);
+                pgmin = std::min(pgmin, PG);
+                if (std::abs(PG) > 1e-12)
+                {
+                    double old = a[i];
+                    a[i] = std::max(a[i] - G / (qii[i] + Dii), 0.0);
+                    axpy(i, (a[i] - old) * y[i], w);
+                }
+            }
+            if (pgmax - pgmin <= eps)
+                break;
+        }
+    }
+
+    //
+    // each row has 2 dual variables, a and C-a, only a gets stored.
+    //
+    void solveLr(int c, const vector<int> &y, double *a, double *w) const
+    {
+        double innereps = 1e-2, innerMin = std::min(1e-8, eps);
+        int n = rows();
+        vector<int> order(n);
+        for (int i=0; i<n; i++) order[i] = i;
+        RNG rng(c + 1);
+        for (int iter=0; iter<maxIter; iter++)
+        {
+            for (int i=0; i<n; i++)
+                std::swap(order[i], order[i + rng.uniform(0, n-i)]);
+
+            double gmax = 0;
+            for (int s=0; s<n; s++)
+            {
+                int i = order[s];
+                double q = qii[i], b = y[i] * dot(i, w);
+
+                // which of the 2 to update
+                int sign = 1;
+                double zold = a[i];
+                if (0.5 * q * ((C - a[i]) - a[i]) + b < 0)
+                {
+                    sign = -1;
+                    zold = C - a[i];
+                }
+                double z = zold;
+                if (C - z < 0.5 * C)
+                    z *= 0.1;
+                double gp = q * (z - zold) + sign * b + std::log(z / (C - z));
+                gmax = std::max(gmax, std::abs(gp));
+
+                // newton on the 1d subproblem
+                int inner = 0;
+                for (; inner<100 && std::abs(gp)>=innereps; inner++)
+                {
+                    double gpp = q + C / (C - z) / z;
+                    double t = z - gp / gpp;
+                    z = (t <= 0) ? z * 0.1 : t;
+                    gp = q * (z - zold) + sign * b + std::log(z / (C - z));
+                }
+                if (inner > 0)
+                {
+                    a[i] = (sign > 0) ? z : C - z;
+                    axpy(i, sign * (z - zold) * y[i], w);
+                }
+            }
+            if (gmax < eps)
+                break;
+            innereps = std::max(innerMin, 0.1 * innereps);
+        }
+    }
+
+    struct Trainer : public ParallelLoopBody
+    {
+        ClassifierLinear &lin;
+
+        Trainer(ClassifierLinear &lin) : lin(lin) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            int n = lin.rows();
+            vector<int> y(n);
+            vector<double> a(n), w(lin.dims + 1, 0.0);
+            for (int c=range.start; c<range.end; c++)
+            {
+                // w from the (maybe warm) dual variables
+                std::fill(w.begin(), w.end(), 0.0);
+                for (int i=0; i<n; i++)
+                {
+                    y[i] = (lin.labels(i) == lin.classes(c)) ? 1 : -1;
+                    a[i] = lin.alpha.at<double>(i, c);
+                    if (a[i] != 0)
+                        lin.axpy(i, a[i] * y[i], &w[0]);
+                }
+                if (lin.loss == LOGISTIC)
+                    lin.solveLr(c, y, &a[0], &w[0]);
+                else
+                    lin.solveSvm(c, y, &a[0], &w[0]);
+
+                for (int i=0; i<n; i++)
+                    lin.alpha.at<double>(i, c) = a[i];
+                Mat(w).reshape(1, 1).convertTo(lin.W.row(c), CV_32F);
+            }
+        }
+    };
+
+    void solve()
+    {
+        W = Mat(classes.rows, dims + 1, CV_32F);
+        parallel_for_(Range(0, classes.rows), Trainer(*this));
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        sparse = false;
+        dense.release();
+        val.clear();
+        col.clear();
+        rowptr.clear();
+        qii.clear();
+        labels.release();
+        classes.release();
+
+        append(trainData);
+        labels = Mat(trainLabels.reshape(1, int(trainLabels.total())).clone());
+        set<int> cls;
+        unique(trainLabels, cls);
+        for (set<int>::iterator it=cls.begin(); it != cls.end(); ++it)
+            classes.push_back(*it);
+        alpha = Mat(rows(), classes.rows, CV_64F, Scalar(alpha0()));
+        solve();
+        return rows();
+    }
+
+    //
+    // new rows start at the initial dual value, new classes get appended,
+    //   everything else continues from where the last run stopped.
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (rowptr.empty())
+            return 0; // loaded, the training rows are not saved
+        append(trainData);
+        Mat l = trainLabels.reshape(1, int(trainLabels.total()));
+        for (int i=0; i<l.rows; i++)
+        {
+            int id = l.at<int>(i);
+            labels.push_back(id);
+            bool known = false;
+            for (int c=0; c<classes.rows && !known; c++)
+                known = (classes(c) == id);
+            if (! known)
+                classes.push_back(id);
+        }
+        Mat a(rows(), classes.rows, CV_64F, Scalar(alpha0()));
+        alpha.copyTo(a(Rect(0, 0, alpha.cols, alpha.rows)));
+        alpha = a;
+        solve();
+        return l.rows;
+    }
+
+    // all decision values at once, queries.rows x classes
+    Mat scores(const Mat &queries) const
+    {
+        Mat q = tofloat(queries.reshape(1, queries.rows)), s;
+        Mat b = W.col(dims).t() * bias;
+        gemm(q, W.colRange(0, dims), 1.0, repeat(b, q.rows, 1), 1.0, s, GEMM_2_T);
+        return s;
+    }
+
+    virtual int predict(const Mat &src, Mat &res) const
+    {
+        Mat s = scores(src.reshape(1,1));
+        Point best;
+        double m;
+        minMaxLoc(s, 0, &m, 0, &best);
+        res = (Mat_<float>(1,2) << float(classes(best.x)), float(m));
+        return res.rows;
+    }
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        Mat s = scores(queries);
+        results = Mat(queries.rows, 3*k, CV_32F, Scalar(-1));
+        for (int i=0; i<s.rows; i++)
+        {
+            TopK top(k);
+            for (int c=0; c<s.cols; c++)
+                top.push(-s.at<float>(i, c), c);
+            for (size_t j=0; j<top.id.size(); j++)
+            {
+                results.at<float>(i, 3*j)   = float(classes(top.id[j]));
+                results.at<float>(i, 3*j+1) = top.dist[j];
+            }
+        }
+        return results.rows;
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "loss" << loss;
+        ar << "C" << C;
+        ar << "bias" << bias;
+        ar << "classes" << Mat(classes);
+        ar << "W" << W;
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        Mat c;
+        ar["loss"] >> loss;
+        ar["C"] >> C;
+        ar["bias"] >> bias;
+        ar["classes"] >> c;
+        ar["W"] >> W;
+        classes = c;
+        dims = W.cols - 1;
+        rowptr.clear();
+        return ! W.empty();
+    }
+};
+
+struct PPCA
+{
+};
+
+
+//
+// C = op(A) * op(B), with the rows of C split across the threads.
+//   (without a blas, cv::gemm runs on a single one)
+//
+struct ParallelGemm : public ParallelLoopBody
+{
+    const Mat &A, &B;
+    Mat &C;
+    int flags;
+
+    ParallelGemm(const Mat &A, const Mat &B, Mat &C, int flags) : A(A), B(B), C(C), flags(flags) {}
+
+    virtual void operator()(const Range &range) const
+    {
+        Mat a = (flags & GEMM_1_T) ? A.colRange(range.start, range.end) : A.rowRange(range.start, range.end);
+        Mat c = C.rowRange(range.start, range.end);
+        gemm(a, B, 1.0, noArray(), 0.0, c, flags);
+    }
+};
+
+static Mat gemmParallel(const Mat &A, const Mat &B, int flags=0)
+{
+    int rows = (flags & GEMM_1_T) ? A.cols : A.rows;
+    int cols = (flags & GEMM_2_T) ? B.rows : B.cols;
+    Mat C(rows, cols, A.type());
+    parallel_for_(Range(0, rows), ParallelGemm(A, B, C, flags), std::min(rows, 4 * getNumThreads()));
+    return C;
+}
+
+//
+// the rows of A are few, the columns many: A = U * diag(w) * vt, from the eigen decomposition of A*A'.
+//   (the 'dual' pca, n x n instead of d x d)
+//
+static void thinSvd(const Mat &A, Mat &w, Mat &vt)
+{
+    Mat G, ev, U;
+    gemmParallel(A, A, GEMM_2_T).convertTo(G, CV_64F);
+    eigen(G, ev, U);
+    double eps = std::max(ev.at<double>(0), DBL_EPSILON) * 1e-10;
+    int r = 0;
+    while (r < ev.rows && ev.at<double>(r) > eps) // sorted descending
+        r++;
+
+    Mat s, Us;
+    cv::sqrt(ev.rowRange(0, r), s);
+    s.convertTo(w, CV_32F);
+    U.rowRange(0, r).convertTo(Us, CV_32F);
+    for (int j=0; j<r; j++)
+        Us.row(j) /= w.at<float>(j);
+    vt = gemmParallel(Us, A);
+}
+
+//
+// Halko, Martinsson, Tropp: "Finding structure with randomness"
+//   a gaussian sketch of the range of A (k+oversample wide), refined with a few power iterations,
+//   then the (small) svd of the projection.
+//
+static void randomizedSvd(const Mat &A, int k, int oversample, int iters, Mat &w, Mat &vt)
+{
+    int l = std::min(k + oversample, std::min(A.rows, A.cols));
+    Mat omega(A.cols, l, CV_32F);
+    RNG rng(0x5eed);
+    rng.fill(omega, RNG::NORMAL, 0, 1);
+
+    // the columns of Q span the range, orthonormal (via the thin svd of Q')
+    Mat Q = gemmParallel(A, omega), qw, qt;
+    thinSvd(Q.t(), qw, qt);
+    for (int i=0; i<iters; i++)
+    {
+        thinSvd(gemmParallel(qt, A), qw, qt);               // Q' * A
+        thinSvd(gemmParallel(A, qt, GEMM_2_T).t(), qw, qt); // A * Q
+    }
+    thinSvd(gemmParallel(qt, A), w, vt);
+    k = std::min(k, vt.rows);
+    w = w.rowRange(0, k).clone();
+    vt = vt.rowRange(0, k).clone();
+}
+
+//
+// Ross, Lim, Lin, Yang: "Incremental Learning for Robust Visual Tracking"
+//   the sequential Karhunen-Loeve update, with the mean correction (like sklearn's IncrementalPCA)
+//
+struct IncrementalPca
+{
+    enum
+    {
+        PCA_AUTO,       // full for d <= n, dual for d > n, both exact (randomized has to be asked for)
+        PCA_FULL,       // cv::PCA, from the d x d covariance
+        PCA_DUAL,       // from the n x n gram matrix
+        PCA_RANDOMIZED  // randomized svd, approximate
+    };
+
+    Mat mean;  // 1 x d
+    Mat basis; // k x d, one component per row
+    Mat sv;    // k x 1, singular values
+    double n;  // rows seen so far
+
+    int method;
+    int oversample; // randomized: extra sketch columns
+    int iters;      // randomized: power iterations
+
+    IncrementalPca(int method=PCA_AUTO, int oversample=10, int iters=2)
+        : n(0)
+        , method(method)
+        , oversample(oversample)
+        , iters(iters)
+    {}
+
+    void fit(const Mat &data, int k)
+    {
+        int m = method;
+        if (m == PCA_AUTO)
+            m = (data.cols > data.rows) ? PCA_DUAL : PCA_FULL;
+        n = data.rows;
+
+        if (m == PCA_FULL)
+        {
+            PCA pca(data, Mat(), cv::PCA::DATA_AS_ROW, k);
+            mean = pca.mean.reshape(1,1);
+            basis = pca.eigenvectors;
+            cv::sqrt(pca.eigenvalues * double(data.rows), sv); // the covariance was scaled by 1/n
+            return;
+        }
+
+        Mat X, w, vt;
+        reduce(data, mean, 0, REDUCE_AVG, CV_32F);
+        subtract(data, repeat(mean, data.rows, 1), X, noArray(), CV_32F);
+        if (m == PCA_DUAL)
+            thinSvd(X, w, vt);
+        else
+            randomizedSvd(X, k, oversample, iters, w, vt);
+        k = std::min(k, vt.rows);
+        basis = vt.rowRange(0, k).clone();
+        sv = w.rowRange(0, k).clone();
+    }
+
+    //
+    // add rows, keep (at most) k components.
+    //   old projections move to the new basis with p' = p * R + o.
+    //
+    void update(const Mat &data, int k, Mat &R, Mat &o)
+    {
+        int m = data.rows, K = basis.rows;
+        Mat bmean;
+        reduce(data, bmean, 0, REDUCE_AVG, CV_32F);
+
+        Mat A(K + m + 1, data.cols, CV_32F);
+        for (int i=0; i<K; i++)
+            A.row(i) = basis.row(i) * sv.at<float>(i);
+        for (int i=0; i<m; i++)
+            A.row(K+i) = data.row(i) - bmean;
+        A.row(K+m) = (mean - bmean) * std::sqrt(n * m / (n + m));
+
+        Mat w, vt;
+        thinSvd(A, w, vt);
+        k = std::min(k, vt.rows);
+        Mat nbasis = vt.rowRange(0, k);
+        Mat nmean = (mean * n + bmean * m) / (n + m);
+
+        R = basis * nbasis.t();
+        o = (mean - nmean) * nbasis.t();
+        basis = nbasis.clone();
+        sv = w.rowRange(0, k).clone();
+        mean = nmean;
+        n += m;
+    }
+};
+
+//
+// per class counts and means, and the within class scatter, for lda.
+//   new rows get merged in (Chan, Golub, LeVeque), and the whole thing can move to a new basis.
+//
+struct IncrementalLda
+{
+    Mat_<int> ids; // class labels
+    Mat counts;    // C x 1
+    Mat means;     // C x p
+    Mat Sw;        // p x p
+
+    void clear()
+    {
+        ids.release();
+        counts.release();
+        means.release();
+        Sw.release();
+    }
+
+    bool empty() const { return means.empty(); }
+    int classes() const { return ids.rows; }
+
+    int find(int id) const
+    {
+        for (int c=0; c<ids.rows; c++)
+            if (ids(c) == id)
+                return c;
+        return -1;
+    }
+
+    // the number of classes, after adding these labels
+    int classesAfter(const Mat &labels) const
+    {
+        set<int> seen;
+        int C = classes();
+        for (size_t i=0; i<labels.total(); i++)
+        {
+            int id = labels.at<int>(int(i));
+            if (id >= 0 && find(id) < 0 && seen.insert(id).second)
+                C++;
+        }
+        return C;
+    }
+
+    void add(const Mat &data, const Mat &labels)
+    {
+        map<int, Mat> rows;
+        for (int i=0; i<data.rows; i++)
+            if (labels.at<int>(i) >= 0) // removed
+                rows[labels.at<int>(i)].push_back(data.row(i));
+        if (Sw.empty())
+            Sw = Mat::zeros(data.cols, data.cols, CV_64F);
+
+        for (map<int, Mat>::iterator it=rows.begin(); it!=rows.end(); ++it)
+        {
+            Mat S, mb;
+            calcCovarMatrix(it->second, S, mb, COVAR_NORMAL|COVAR_ROWS, CV_64F);
+            double m = it->second.rows;
+            int c = find(it->first);
+            if (c < 0)
+            {
+                ids.push_back(it->first);
+                counts.push_back(m);
+                means.push_back(mb);
+                Sw += S;
+                continue;
+            }
+            double n = counts.at<double>(c), nn = n + m;
+            Mat delta = mb - means.row(c);
+            Sw += S + delta.t() * delta * (n * m / nn);
+            Mat mc = means.row(c);
+            mc += delta * (m / nn);
+            counts.at<double>(c) = nn;
+        }
+    }
+
+    //
+    // the inverse of add(), the rows leave their class, an empty class gets dropped.
+    //   (the rows have to be the ones, that were added)
+    //
+    void remove(const Mat &data, const Mat &labels)
+    {
+        map<int, Mat> rows;
+        for (int i=0; i<data.rows; i++)
+            if (labels.at<int>(i) >= 0)
+                rows[labels.at<int>(i)].push_back(data.row(i));
+
+        for (map<int, Mat>::iterator it=rows.begin(); it!=rows.end(); ++it)
+        {
+            int c = find(it->first);
+            if (c < 0)
+                continue;
+            Mat S, mb;
+            calcCovarMatrix(it->second, S, mb, COVAR_NORMAL|COVAR_ROWS, CV_64F);
+            double n = counts.at<double>(c), m = it->second.rows, nn = n - m;
+            if (nn < 0.5)
+            {
+                Sw -= S;
+                drop(c);
+                continue;
+            }
+            Mat mc = means.row(c);
+            Mat rest = (mc * n - mb * m) / nn;
+            Mat delta = mb - rest;
+            Sw -= S + delta.t() * delta * (nn * m / n);
+            rest.copyTo(mc);
+            counts.at<double>(c) = nn;
+        }
+    }
+
+    void drop(int c)
+    {
+        Mat_<int> i;
+        Mat n, m;
+        for (int k=0; k<ids.rows; k++)
+        {
+            if (k == c)
+                continue;
+            i.push_back(ids(k));
+            n.push_back(counts.row(k));
+            m.push_back(means.row(k));
+        }
+        ids = i;
+        counts = n;
+        means = m;
+    }
+
+    // p' = p * R + o
+    void transform(const Mat &R, const Mat &o)
+    {
+        Mat r, t;
+        R.convertTo(r, CV_64F);
+        o.convertTo(t, CV_64F);
+        means = means * r + repeat(t, means.rows, 1);
+        Sw = r.t() * Sw * r;
+    }
+
+    //
+    // whiten Sw, then Sb (rank C-1) in its dual form, C x C.
+    //   returns (at most) k projections, p x k
+    //
+    Mat solve(int k) const
+    {
+        Mat evals, evecs, W;
+        eigen(Sw, evals, evecs);
+        double eps = std::max(evals.at<double>(0), DBL_EPSILON) * 1e-9;
+        for (int j=0; j<evals.rows; j++)
+        {
+            double l = evals.at<double>(j);
+            if (l <= eps) break; // sorted descending
+            W.push_back(Mat(evecs.row(j) / std::sqrt(l)));
+        }
+        W = W.t();
+
+        Mat mu = counts.t() * means / sum(counts)[0];
+        Mat D = means - repeat(mu, means.rows, 1);
+        for (int c=0; c<D.rows; c++)
+            D.row(c) *= std::sqrt(counts.at<double>(c));
+        D = D * W;
+
+        Mat gv, gu, L;
+        eigen(D * D.t(), gv, gu);
+        eps = std::max(gv.at<double>(0), DBL_EPSILON) * 1e-9;
+        for (int j=0; j<std::min(k, gv.rows); j++)
+        {
+            double l = gv.at<double>(j);
+            if (l <= eps) break;
+            Mat v = D.t() * gu.row(j).t() / std::sqrt(l);
+            L.push_back(Mat((W * v).t()));
+        }
+        Mat L32;
+        Mat(L.t()).convertTo(L32, CV_32F);
+        return L32;
+    }
+
+    void save(Archive &ar) const
+    {
+        ar << "lda_ids" << Mat(ids);
+        ar << "lda_counts" << counts;
+        ar << "lda_means" << means;
+        ar << "lda_sw" << Sw;
+    }
+
+    void load(const Archive &ar)
+    {
+        Mat i;
+        ar["lda_ids"] >> i;
+        ids = i;
+        ar["lda_counts"] >> counts;
+        ar["lda_means"] >> means;
+        ar["lda_sw"] >> Sw;
+    }
+};
+
+//
+// removed rows leave the lda statistics right away, and their rows in the subspace get wiped,
+//   so neither the next solve(), nor a save() knows them any more.
+//   (the row indices stay, the tombstones go with the next compact())
+//
+static void forgetRows(IncrementalLda &stats, Gallery &sub, const Gallery &labels, const vector<int> &rows)
+{
+    Mat data, lab;
+    for (size_t i=0; i<rows.size(); i++)
+    {
+        data.push_back(sub.row(rows[i]));
+        lab.push_back(labels.at<int>(rows[i]));
+    }
+    if (! data.empty())
+        stats.remove(data, lab);
+    for (size_t i=0; i<rows.size(); i++)
+    {
+        Mat r = sub.row(rows[i]);
+        r.setTo(0);
+    }
+}
+
+//
+//
+// 'Eigenfaces'
+//
+struct ClassifierPCA : public ClassifierNearestFloat
+{
+    Mat eigenvectors;
+    Mat mean;
+    int num_components; // 0: as many as rows
+    IncrementalPca ipca;
+
+    // method, oversample, iters: see IncrementalPca
+    ClassifierPCA(int num_components=0, int method=IncrementalPca::PCA_AUTO, int oversample=10, int iters=2)
+        : num_components(num_components)
+        , ipca(method, oversample, iters)
+    {}
+
+    inline
+    Mat project(const Mat &src) const
+    {
+        return LDA::subspaceProject(eigenvectors, mean, src);
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        int K = num_components;
+        if((K <= 0) || (K > trainData.rows))
+            K = trainData.rows;
+
+        ipca.fit(tofloat(trainData), K);
+
+        transpose(ipca.basis, eigenvectors);
+        mean = ipca.mean;
+        setGallery(project(trainData), trainLabels);
+        return 1;
+    }
+
+    //
+    // update the basis with the new rows, move the gallery to the new basis (one gemm),
+    //   then add the projected new rows.
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (ipca.sv.empty())
+            return 0; // the model was saved without the pca state
+        Mat data = tofloat(trainData), R, o;
+        int K = (num_components > 0) ? num_components : ipca.basis.rows + data.rows;
+        ipca.update(data, K, R, o);
+
+        transpose(ipca.basis, eigenvectors);
+        mean = ipca.mean;
+        reproject(R, o);
+        return ClassifierNearestFloat::update(project(data), trainLabels);
+    }
+
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        return ClassifierNearestFloat::predict(project(tofloat(testFeature)), results);
+    }
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        return ClassifierNearestFloat::predictBatch(project(tofloat(queries)), k, results);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        saveGallery(ar);
+        ar << "mean" << mean;
+        ar << "eigenvectors" << eigenvectors;
+        ar << "num_components" << num_components;
+        ar << "pca_sv" << ipca.sv;
+        ar << "pca_n" << ipca.n;
+        if (ann) ann->save(ar);
+        return true;
+    }
+    virtual bool load(const Archive &ar)
+    {
+        loadGallery(ar);
+        ar["mean"] >> mean;
+        ar["eigenvectors"] >> eigenvectors;
+        ar["num_components"] >>num_components;
+        ar["pca_sv"] >> ipca.sv;
+        ar["pca_n"] >> ipca.n;
+        ipca.mean = mean;
+        ipca.basis = eigenvectors.t();
+        prepare();
+        loadIndex(ar);
+        return ! features.empty();
+    }
+};
+
+
+//
+// 'Fisherfaces'
+//
+struct ClassifierPCA_LDA : public ClassifierPCA
+{
+    bool useMahalanobis;
+    Mat whiten; // icovar = whiten * whiten', already folded into the eigenvectors
+    IncrementalLda stats; // class statistics in pca space
+    Gallery pcaspace;     // the gallery in pca space, the lda part gets re-solved on update()
+
+    ClassifierPCA_LDA(int num_components=0, bool useMahalanobis=true, int method=IncrementalPca::PCA_AUTO, int oversample=10, int iters=2)
+        : ClassifierPCA(num_components, method, oversample, iters)
+        , useMahalanobis(useMahalanobis)
+    {}
+
+    Mat pcaProject(const Mat &src) const
+    {
+        return LDA::subspaceProject(ipca.basis.t(), ipca.mean, src);
+    }
+
+    //
+    // lda on the pca space statistics, then combine both, and project the gallery.
+    //
+    void solve(const Mat &lab)
+    {
+        int k = num_components;
+        if((k <= 0) || (k > (stats.classes()-1)))
+            k = (stats.classes()-1);
+
+        Mat leigen = stats.solve(k);
+        gemm(ipca.basis, leigen, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T);
+        mean = ipca.mean;
+        Mat proj_all = pcaspace.contiguous() * leigen;
+
+        // mahalanobis is plain L2 in whitened space:
+        //   icovar = V * diag(1/l) * V' = W * W', with W = V * diag(1/sqrt(l)),
+        //   so fold W into the projection, and use the gemm nearest neighbour.
+        whiten.release();
+        if (useMahalanobis)
+        {
+            // the covariance only from the live rows, the removed ones are zeroed, not gone
+            Mat_<int> ids(lab.reshape(1, int(lab.total())));
+            Mat live;
+            for (int i=0; i<proj_all.rows; i++)
+                if (ids(i) >= 0)
+                    live.push_back(proj_all.row(i));
+            Mat _covar, _mean;
+            calcCovarMatrix(live, _covar, _mean, CV_COVAR_NORMAL|CV_COVAR_ROWS, CV_32F);
+            _covar /= std::max(live.rows-1, 1);
+
+            Mat evals, evecs;
+            eigen(_covar, evals, evecs);
+            float eps = std::max(evals.at<float>(0), FLT_EPSILON) * 1e-6f; // like the svd pseudo-inverse
+            for (int j=0; j<evals.rows; j++)
+            {
+                float l = evals.at<float>(j);
+                if (l <= eps) break; // sorted descending
+                whiten.push_back(Mat(evecs.row(j) / std::sqrt(l)));
+            }
+            whiten = whiten.t();
+            eigenvectors = eigenvectors * whiten;
+            proj_all = proj_all * whiten;
+        }
+        setGallery(proj_all, lab);
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        set<int> classes;
+        int C = TextureFeatureImpl::unique(trainLabels,classes);
+        int N = trainData.rows;
+
+        // step one, do pca on the original data:
+        ipca.fit(tofloat(trainData), (N-C));
+
+        // step two, collect the class statistics in pca space:
+        Mat proj = pcaProject(trainData);
+        stats.clear();
+        stats.add(proj, trainLabels);
+        pcaspace = Gallery(proj);
+
+        // step three, lda, combine both, keep labels and projected dataset:
+        solve(trainLabels);
+        return 1;
+    }
+
+    //
+    // the pca basis gets updated first, the pca space gallery and the class statistics
+    //   move along (exact, they live in the old subspace), then the new rows get added,
+    //   and the (small) lda problem is solved again.
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (ipca.sv.empty() || stats.empty())
+            return 0; // the model was saved without the pca / lda state
+        Mat data = tofloat(trainData), R, o;
+        int N = int(ipca.n) + data.rows;
+        int C = stats.classesAfter(trainLabels);
+        ipca.update(data, std::min(N-C, ipca.basis.rows + data.rows), R, o);
+
+        Mat ps = pcaspace.contiguous();
+        if (! ps.empty())
+            pcaspace = Gallery(Mat(ps * R + repeat(o, ps.rows, 1)));
+        stats.transform(R, o);
+
+        Mat proj = pcaProject(data);
+        stats.add(proj, trainLabels);
+        pcaspace.push_back(proj);
+
+        Mat lab = labels.contiguous().clone(); // might be the mapped file
+        lab.push_back(trainLabels.reshape(1, int(trainLabels.total())));
+        solve(lab);
+        return 1;
+    }
+
+    virtual int compact()
+    {
+        if (dead == 0)
+            return 0;
+        pcaspace = survivors(pcaspace);
+        return ClassifierPCA::compact();
+    }
+
+    // the alive rows of a label, or a single one
+    int forget(const vector<int> &rows)
+    {
+        bool tracked = !stats.empty() && pcaspace.rows() == labels.rows(); // else saved without the lda state
+        if (tracked)
+            forgetRows(stats, pcaspace, labels, rows);
+        int n = 0;
+        for (size_t i=0; i<rows.size(); i++)
+            n += kill(rows[i]);
+        if (tracked && n > 0 && stats.classes() > 1)
+            solve(labels.contiguous().clone()); // might be the mapped file
+        return n;
+    }
+
+    virtual int removeIndex(int r)
+    {
+        CV_Assert(r >= 0 && r < labels.rows());
+        if (labels.at<int>(r) < 0)
+            return 0;
+        return forget(vector<int>(1, r));
+    }
+
+    virtual int removeLabel(int label)
+    {
+        vector<int> rows;
+        for (int r=0; r<labels.rows(); r++)
+            if (labels.at<int>(r) == label)
+                rows.push_back(r);
+        return forget(rows);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ClassifierPCA::save(ar);
+        ar << "useMahalanobis" << int(useMahalanobis);
+        ar << "whiten" << whiten;
+        ar << "pca_basis" << ipca.basis;
+        ar << "pcaspace" << pcaspace.contiguous();
+        stats.save(ar);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        int m = 0;
+        ar["useMahalanobis"] >> m;
+        ar["whiten"] >> whiten;
+        useMahalanobis = (m != 0);
+        bool ok = ClassifierPCA::load(ar);
+        Mat basis, ps;
+        ar["pca_basis"] >> basis;
+        ar["pcaspace"] >> ps;
+        ipca.basis = basis;
+        pcaspace = Gallery(ps);
+        stats.load(ar);
+        return ok;
+    }
+};
+
+//
+// the lda gets solved again on update(), so the training rows are kept along.
+//   for d > n they live in the (lossless) span of the training set,
+//   so the scatter matrices are n x n, not d x d.
+//
+struct ClassifierLDA : public ClassifierNearestFloat
+{
+    IncrementalPca span;  // empty for d <= n
+    IncrementalLda stats; // class statistics in span coordinates
+    Gallery coords;       // the training rows in span coordinates
+    Mat eigenvectors;     // the span folded in
+    Mat mean;
+
+    ClassifierLDA() : span(IncrementalPca::PCA_DUAL) {}
+
+    Mat project(const Mat &src) const
+    {
+        return LDA::subspaceProject(eigenvectors, mean, src);
+    }
+
+    Mat toSpan(const Mat &src) const
+    {
+        if (span.basis.empty())
+            return tofloat(src);
+        return LDA::subspaceProject(span.basis.t(), span.mean, src);
+    }
+
+    void solve(const Mat &lab)
+    {
+        Mat L = stats.solve(stats.classes()-1);
+        if (span.basis.empty())
+            eigenvectors = L;
+        else
+            gemm(span.basis, L, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T);
+        mean = span.mean;
+        setGallery(coords.contiguous() * L, lab);
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        Mat data = tofloat(trainData);
+        span = IncrementalPca(IncrementalPca::PCA_DUAL);
+        if (data.cols > data.rows)
+            span.fit(data, data.rows); // all of it
+        Mat c = toSpan(data);
+        stats.clear();
+        stats.add(c, trainLabels);
+        coords = Gallery(c);
+        solve(trainLabels);
+        return 1;
+    }
+
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (stats.empty())
+            return 0;
+        Mat data = tofloat(trainData);
+        if (! span.basis.empty())
+        {
+            // grow the span (nothing gets dropped), and move along
+            Mat R, o;
+            span.update(data, span.basis.rows + data.rows, R, o);
+            Mat c = coords.contiguous();
+            if (! c.empty())
+                coords = Gallery(Mat(c * R + repeat(o, c.rows, 1)));
+            stats.transform(R, o);
+        }
+        Mat c = toSpan(data);
+        stats.add(c, trainLabels);
+        coords.push_back(c);
+
+        Mat lab = labels.contiguous().clone(); // might be the mapped file
+        lab.push_back(trainLabels.reshape(1, int(trainLabels.total())));
+        solve(lab);
+        return 1;
+    }
+
+    virtual int predict(const Mat &a, Mat &res) const
+    {
+        return ClassifierNearestFloat::predict(project(a), res);
+    }
+
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+    {
+        return ClassifierNearestFloat::predictBatch(project(queries), k, results);
+    }
+
+    virtual int compact()
+    {
+        if (dead == 0)
+            return 0;
+        coords = survivors(coords);
+        return ClassifierNearestFloat::compact();
+    }
+
+    // the alive rows of a label, or a single one
+    int forget(const vector<int> &rows)
+    {
+        bool tracked = !stats.empty() && coords.rows() == labels.rows(); // else saved without the lda state
+        if (tracked)
+            forgetRows(stats, coords, labels, rows);
+        int n = 0;
+        for (size_t i=0; i<rows.size(); i++)
+            n += kill(rows[i]);
+        if (tracked && n > 0 && stats.classes() > 1)
+            solve(labels.contiguous().clone()); // might be the mapped file
+        return n;
+    }
+
+    virtual int removeIndex(int r)
+    {
+        CV_Assert(r >= 0 && r < labels.rows());
+        if (labels.at<int>(r) < 0)
+            return 0;
+        return forget(vector<int>(1, r));
+    }
+
+    virtual int removeLabel(int label)
+    {
+        vector<int> rows;
+        for (int r=0; r<labels.rows(); r++)
+            if (labels.at<int>(r) == label)
+                rows.push_back(r);
+        return forget(rows);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        saveGallery(ar);
+        ar << "eigenvectors" << eigenvectors;
+        ar << "mean" << mean;
+        ar << "span_mean" << span.mean;
+        ar << "span_basis" << span.basis;
+        ar << "span_sv" << span.sv;
+        ar << "span_n" << span.n;
+        ar << "coords" << coords.contiguous();
+        stats.save(ar);
+        if (ann) ann->save(ar);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        Mat c;
+        loadGallery(ar);
+        ar["eigenvectors"] >> eigenvectors;
+        ar["mean"] >> mean;
+        ar["span_mean"] >> span.mean;
+        ar["span_basis"] >> span.basis;
+        ar["span_sv"] >> span.sv;
+        ar["span_n"] >> span.n;
+        ar["coords"] >> c;
+        coords = Gallery(c);
+        stats.load(ar);
+        prepare();
+        loadIndex(ar);
+        return ! features.empty();
+    }
+};
+
+//
+// fully connected, scaled tanh on the hidden layers (like opencv's SIGMOID_SYM), softmax on the output.
+//   trained with adam on shuffled mini-batches, the forward and backward passes are (threaded) gemms.
+//   a part of the training set is held out, training stops, when its loss does not improve any more,
+//   and the best weights seen so far are kept.
+//
+struct ClassifierMLP : Classifier
+{
+    int batchSize;
+    int maxEpochs;
+    int patience;    // epochs without improvement on the held out set
+    float holdout;   // part of the training set
+    float lr;        // adam step size
+
+    Mat_<int> classes;
+    Mat inMean, inScale; // the inputs get standardized
+    vector<Mat> W, b;    // per layer: in x out, 1 x out
+
+    ClassifierMLP(int batchSize=64, int maxEpochs=200, int patience=10, float holdout=0.1f, float lr=1e-3f)
+        : batchSize(batchSize)
+        , maxEpochs(maxEpochs)
+        , patience(patience)
+        , holdout(holdout)
+        , lr(lr)
+    {}
+
+    // the topology: input, 2 hidden layers, output
+    static Mat_<int> layout(int ni, int no)
+    {
+        Mat_<int> layers(4,1);
+        layers(0) = ni;
+        layers(1) = no>2 ? no*2 : 128;
+        layers(2) = no>2 ? no*8 : 8;
+        layers(3) = no;
+        return layers;
+    }
+
+    // the same net, as an opencv model
+    static Ptr<ml::ANN_MLP> setup(int ni, int no)
+    {
+        Ptr<ml::ANN_MLP> ann = ml::ANN_MLP::create();
+        ann->setLayerSizes(layout(ni, no));
+        ann->setActivationFunction(ml::ANN_MLP::SIGMOID_SYM,0,0);
+        ann->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 300, 0.0001));
+        ann->setTrainMethod(ml::ANN_MLP::BACKPROP, 0.0001);
+        return ann;
+    }
+
+    static inline float act(float z)   { return 1.7159f * std::tanh(0.6666667f * z); }
+    static inline float deriv(float a) { return 0.6666667f * (1.7159f - a * a / 1.7159f); } // from the activation
+
+    // activations of all layers, a[0] is the (standardized) input
+    void forward(const Mat &x, vector<Mat> &a) const
+    {
+        a.resize(W.size() + 1);
+        a[0] = x;
+        for (size_t l=0; l<W.size(); l++)
+        {
+            Mat z = gemmParallel(a[l], W[l]);
+            for (int r=0; r<z.rows; r++)
+            {
+                float *zr = z.ptr<float>(r);
+                const float *br = b[l].ptr<float>();
+                for (int c=0; c<z.cols; c++)
+                    zr[c] = (l+1 < W.size()) ? act(zr[c] + br[c]) : zr[c] + br[c];
+            }
+            a[l+1] = z;
+        }
+        // softmax
+        Mat &o = a.back();
+        for (int r=0; r<o.rows; r++)
+        {
+            float *p = o.ptr<float>(r);
+            float m = *std::max_element(p, p + o.cols), s = 0;
+            for (int c=0; c<o.cols; c++)
+                s += (p[c] = std::exp(p[c] - m));
+            for (int c=0; c<o.cols; c++)
+                p[c] /= s;
+        }
+    }
+
+    Mat standardize(const Mat &src) const
+    {
+        Mat x = tofloat(src.reshape(1, src.rows)).clone();
+        for (int r=0; r<x.rows; r++)
+        {
+            Mat xr = x.row(r);
+            xr = (xr - inMean).mul(inScale);
+        }
+        return x;
+    }
+
+    // mean cross entropy
+    static double loss(const Mat &p, const vector<int> &y, const vector<int> &idx)
+    {
+        double l = 0;
+        for (size_t i=0; i<idx.size(); i++)
+            l -= std::log(std::max(p.at<float>(int(i), y[idx[i]]), 1e-12f));
+        return l / std::max(size_t(1), idx.size());
+    }
+
+    static Mat rows(const Mat &m, const vector<int> &idx, size_t from, size_t to)
+    {
+        Mat r(int(to - from), m.cols, m.type());
+        for (size_t i=from; i<to; i++)
+            m.row(idx[i]).copyTo(r.row(int(i - from)));
+        return r;
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        set<int> cls;
+        int C = TextureFeatureImpl::unique(trainLabels, cls);
+        classes.release();
+        for (set<int>::iterator it=cls.begin(); it!=cls.end(); ++it)
+            classes.push_back(*it);
+        vector<int> y(trainLabels.total()); // class index
+        for (size_t i=0; i<y.size(); i++)
+            y[i] = int(std::distance(cls.begin(), cls.find(trainLabels.at<int>(int(i)))));
+
+        Mat data = tofloat(trainData.reshape(1, int(y.size())));
+        reduce(data, inMean, 0, REDUCE_AVG, CV_32F);
+        Mat sq;
+        reduce(data.mul(data), sq, 0, REDUCE_AVG, CV_32F);
+        cv::sqrt(max(sq - inMean.mul(inMean), 0), inScale);
+        inScale = 1.0 / max(inScale, 1e-6f);
+        Mat X = standardize(data);
+
+        // weights, glorot uniform
+        Mat_<int> layers = layout(X.cols, C);
+        RNG rng(0x3f1);
+        W.clear();
+        b.clear();
+        for (int l=0; l+1<layers.rows; l++)
+        {
+            float r = std::sqrt(6.0f / (layers(l) + layers(l+1)));
+            Mat w(layers(l), layers(l+1), CV_32F);
+            rng.fill(w, RNG::UNIFORM, -r, r);
+            W.push_back(w);
+            b.push_back(Mat::zeros(1, layers(l+1), CV_32F));
+        }
+        vector<Mat> mW, vW, mb, vb; // adam moments
+        for (size_t l=0; l<W.size(); l++)
+        {
+            mW.push_back(Mat::zeros(W[l].size(), CV_32F));
+            vW.push_back(Mat::zeros(W[l].size(), CV_32F));
+            mb.push_back(Mat::zeros(b[l].size(), CV_32F));
+            vb.push_back(Mat::zeros(b[l].size(), CV_32F));
+        }
+
+        // split off the held out set
+        vector<int> order(X.rows);
+        for (size_t i=0; i<order.size(); i++) order[i] = int(i);
+        for (int i=X.rows-1; i>0; i--)
+            std::swap(order[i], order[rng.uniform(0, i+1)]);
+        int nval = (X.rows >= 20) ? int(X.rows * holdout) : 0;
+        vector<int> val(order.begin(), order.begin() + nval), tr(order.begin() + nval, order.end());
+        Mat Xval = rows(X, val, 0, val.size());
+
+        const float b1 = 0.9f, b2 = 0.999f, e = 1e-8f;
+        int t = 0, bad = 0;
+        double best = DBL_MAX;
+        vector<Mat> bestW, bestB, a;
+        for (int epoch=0; epoch<maxEpochs && bad<patience; epoch++)
+        {
+            for (int i=int(tr.size())-1; i>0; i--)
+                std::swap(tr[i], tr[rng.uniform(0, i+1)]);
+
+            for (size_t from=0; from<tr.size(); from+=batchSize)
+            {
+                size_t to = std::min(tr.size(), from + batchSize);
+                forward(rows(X, tr, from, to), a);
+
+                // softmax + cross entropy: dz = (p - y) / n
+                Mat dz = a.back().clone();
+                for (size_t i=from; i<to; i++)
+                    dz.at<float>(int(i - from), y[tr[i]]) -= 1.0f;
+                dz /= float(to - from);
+
+                t++;
+                float c1 = 1.0f / (1.0f - std::pow(b1, float(t))), c2 = 1.0f / (1.0f - std::pow(b2, float(t)));
+                for (int l=int(W.size())-1; l>=0; l--)
+                {
+                    Mat gW = gemmParallel(a[l], dz, GEMM_1_T), gb;
+                    reduce(dz, gb, 0, REDUCE_SUM, CV_32F);
+                    if (l > 0) // backprop through the activation
+                    {
+                        Mat da = gemmParallel(dz, W[l], GEMM_2_T);
+                        for (int r=0; r<da.rows; r++)
+                        {
+                            float *d = da.ptr<float>(r);
+                            const float *al = a[l].ptr<float>(r);
+                            for (int c=0; c<da.cols; c++)
+                                d[c] *= deriv(al[c]);
+                        }
+                        dz = da;
+                    }
+                    Mat *p[2] = {&W[l], &b[l]}, *g[2] = {&gW, &gb}, *m[2] = {&mW[l], &mb[l]}, *v[2] = {&vW[l], &vb[l]};
+                    for (int k=0; k<2; k++)
+                    {
+                        *m[k] = b1 * *m[k] + (1 - b1) * *g[k];
+                        *v[k] = b2 * *v[k] + (1 - b2) * g[k]->mul(*g[k]);
+                        Mat den;
+                        cv::sqrt(*v[k] * c2, den);
+                        *p[k] -= (lr * c1) * m[k]->mul(1.0 / (den + e));
+                    }
+                }
+            }
+
+            if (nval == 0)
+                continue;
+            forward(Xval, a);
+            double l = loss(a.back(), y, val);
+            if (l < best)
+            {
+                best = l;
+                bad = 0;
+                bestW.clear();
+                bestB.clear();
+                for (size_t k=0; k<W.size(); k++)
+                {
+                    bestW.push_back(W[k].clone());
+                    bestB.push_back(b[k].clone());
+                }
+            }
+            else bad++;
+        }
+        if (! bestW.empty())
+        {
+            W = bestW;
+            b = bestB;
+        }
+        return X.rows;
+    }
+
+    // class probabilities, one row per query
+    Mat probabilities(const Mat &queries) const
+    {
+        vector<Mat> a;
+        forward(standardize(queries), a);
+        return a.back();
+    }
 
-        transpose(pca.eigenvectors, eigenvectors);
-        mean = pca.mean.reshape(1,1);
-        labels = trainLabels;
-        features = project(trainData);
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        Mat p = probabilities(testFeature.reshape(1,1));
+        Point best;
+        minMaxLoc(p, 0, 0, 0, &best);
+        results = (Mat_<float>(1,1) << float(classes(best.x)));
         return 1;
     }
 
-    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    virtual int predictBatch(const Mat &queries, int k, Mat &results) const
     {
-        return ClassifierNearestFloat::predict(project(tofloat(testFeature)), results);
+        Mat p = probabilities(queries);
+        results = Mat(queries.rows, 3*k, CV_32F, Scalar(-1));
+        for (int i=0; i<p.rows; i++)
+        {
+            TopK top(k);
+            for (int c=0; c<p.cols; c++)
+                top.push(1.0f - p.at<float>(i, c), c);
+            for (size_t j=0; j<top.id.size(); j++)
+            {
+                results.at<float>(i, 3*j)   = float(classes(top.id[j]));
+                results.at<float>(i, 3*j+1) = top.dist[j];
+            }
+        }
+        return results.rows;
     }
 
     // Serialize
-    virtual bool save(FileStorage &fs) const
+    virtual bool save(Archive &ar) const
     {
-        fs << "labels" << labels;
-        fs << "features" << features;
-        fs << "mean" << mean;
-        fs << "eigenvectors" << eigenvectors;
-        fs << "num_components" << num_components;
+        ar << "classes" << Mat(classes);
+        ar << "inMean" << inMean;
+        ar << "inScale" << inScale;
+        ar << "W" << W;
+        ar << "b" << b;
         return true;
     }
-    virtual bool load(const FileStorage &fs)
+
+    virtual bool load(const Archive &ar)
     {
-        fs["labels"] >> labels;
-        fs["features"] >> features;
-        fs["mean"] >> mean;
-        fs["eigenvectors"] >> eigenvectors;
-        fs["num_components"] >>num_components;
-        return ! features.empty();
+        Mat c;
+        ar["classes"] >> c;
+        ar["inMean"] >> inMean;
+        ar["inScale"] >> inScale;
+        ar["W"] >> W;
+        ar["b"] >> b;
+        classes = c;
+        return ! W.empty();
     }
 };
 
 
 //
-// 'Fisherfaces'
+// knn search for ClassifierKNN and VerifierKNN, flann or the hnsw graph.
+//   hamming for binary features, L2 else.
+//   trees and k-means only work on float, lsh only on binary, the other one gets picked instead.
 //
-struct ClassifierPCA_LDA : public ClassifierPCA
+struct KnnIndex : public HnswSpace
 {
-    bool useMahalanobis;
-    Mat icovar;
-    ClassifierPCA_LDA(int num_components=0, bool useMahalanobis=true)
-        : ClassifierPCA(num_components)
-        , useMahalanobis(useMahalanobis)
+    enum { KNN_LINEAR, KNN_HNSW, KNN_KDTREE, KNN_KMEANS, KNN_LSH };
+
+    int algo;
+    int trees;    // kdtree forest size
+    int branch;   // kmeans branching
+    int checks;   // leafs to visit while searching, recall <-> speed
+    int M;        // hnsw links per node
+    int efc;      // hnsw beam width while building
+    int ef;       // hnsw beam width while searching
+    Mat features; // flann only keeps the data pointer, so hold on to it
+    Ptr<cv::flann::Index> flann;
+    Ptr<Hnsw> graph;
+
+    KnnIndex(int algo=KNN_LINEAR, int trees=4, int branch=32, int checks=64, int M=16, int efc=200, int ef=64)
+        : algo(algo)
+        , trees(trees)
+        , branch(branch)
+        , checks(checks)
+        , M(M)
+        , efc(efc)
+        , ef(ef)
     {}
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    Ptr<cv::flann::IndexParams> params() const
     {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels,classes);
-        int N = trainData.rows;
-        if((num_components <= 0) || (num_components > (C-1)))
-            num_components = (C-1);
-
-        // step one, do pca on the original data:
-        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, (N-C));
-        mean = pca.mean.reshape(1,1);
-
-        // step two, do lda on data projected to pca space:
-        Mat proj = LDA::subspaceProject(pca.eigenvectors.t(), mean, trainData);
-        LDA lda(proj, trainLabels, num_components);
-
-        // step three, combine both:
-        Mat leigen;
-        lda.eigenvectors().convertTo(leigen, pca.eigenvectors.type());
-        gemm(pca.eigenvectors, leigen, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T);
-
-        // step four, keep labels and projected dataset:
-        features = project(trainData);
-        labels = trainLabels;
-
-        // while we're at it, precalculate the inverse covariance matrix:
-        if (useMahalanobis)
+        bool bin = (features.type() == CV_8U);
+        int a = algo;
+        if (bin && (a == KNN_KDTREE || a == KNN_KMEANS))
+            a = KNN_LSH;
+        if (!bin && a == KNN_LSH)
+            a = KNN_KDTREE;
+        switch(a)
         {
-            Mat _covar, _mean;
-            calcCovarMatrix(features, _covar, _mean, CV_COVAR_NORMAL|CV_COVAR_ROWS, CV_32F);
-            _covar /= (features.rows-1);
-            invert(_covar, icovar, DECOMP_SVD);
+            case KNN_KDTREE: return makePtr<cv::flann::KDTreeIndexParams>(trees);
+            case KNN_KMEANS: return makePtr<cv::flann::KMeansIndexParams>(branch, 11);
+            case KNN_LSH:    return makePtr<cv::flann::LshIndexParams>(12, 20, 2);
         }
-
-        return 1;
+        return makePtr<cv::flann::LinearIndexParams>();
     }
 
-    virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
+    cvflann::flann_distance_t distType() const
     {
-        return Mahalanobis(testFeature, trainFeature, icovar);
+        return (features.type() == CV_8U) ? cvflann::FLANN_DIST_HAMMING : cvflann::FLANN_DIST_L2;
     }
 
-    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    // HnswSpace
+    virtual float dist(const Mat &query, int id) const
     {
-        Mat q = project(tofloat(testFeature));
-
-        if (! useMahalanobis) // fall back to plain L2 norm
-            return ClassifierNearestFloat::predict(q, results);
-
-        int minId = -1;
-        double minDist = 999999999;
-        nearest(q, features, minId, minDist, *this);
-        results = (Mat_<float>(1,3) << float(labels.at<int>(minId)), float(minDist), float(minId));
-        return 1;
+        return float(norm(query, features.row(id), features.type()==CV_8U ? NORM_HAMMING : NORM_L2SQR));
     }
-};
-
-struct ClassifierLDA : public ClassifierNearestFloat
-{
-    Ptr<LDA> lda;
-    Mat mean;
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    virtual Mat item(int id) const
     {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels,classes);
-        int N = trainData.rows;
-        int num_components = (C-1);
-
-        lda.release();
-        lda = makePtr<LDA>(num_components);
-        lda->compute(trainData, trainLabels);
-
-        //reduce(trainData,mean,0,cv::REDUCE_AVG,CV_64F);
-
-        Mat projected = lda->project(trainData);
-        return ClassifierNearestFloat::train(projected, trainLabels);
+        return features.row(id);
     }
 
-    virtual int predict(const Mat &a, Mat &res) const
+    void build(const Mat &data)
     {
-        Mat pa = lda->project(tofloat(a));
-        return ClassifierNearestFloat::predict(pa, res);
+        features = data;
+        flann.release();
+        graph.release();
+        if (algo == KNN_HNSW)
+        {
+            graph = makePtr<Hnsw>(M, efc, ef);
+            graph->add(*this, 0, features.rows);
+            return;
+        }
+        flann = makePtr<cv::flann::Index>(features, *params(), distType());
     }
-};
-
-struct ClassifierMLP : Classifier
-{
-    Ptr<ml::ANN_MLP> ann;
 
-    static Ptr<ml::ANN_MLP> setup(int ni, int no)
+    void add(const Mat &data)
     {
-        Ptr<ml::ANN_MLP> ann = ml::ANN_MLP::create();
-        Mat_<int> layers(4,1);
-        layers(0) = ni;
-        layers(1) = no>2 ? no*2 : 128;
-        layers(2) = no>2 ? no*8 : 8;
-        layers(3) = no;
-        ann->setLayerSizes(layers);
-        ann->setActivationFunction(ml::ANN_MLP::SIGMOID_SYM,0,0);
-        ann->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 300, 0.0001));
-        ann->setTrainMethod(ml::ANN_MLP::BACKPROP, 0.0001);
-        return ann;
+        int n = features.rows;
+        features.push_back(data);
+        if (graph)
+            graph->add(*this, n, features.rows);
+        else
+            build(features); // the data pointer might have moved
     }
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    void knn(const Mat &query, int K, Mat_<int> &indices) const
     {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels, classes);
-
-        ann = setup(trainData.cols, C);
-
-        Mat trainClasses = Mat::zeros(trainLabels.total(), C, CV_32FC1);
-        for(int i=0; i < trainClasses.rows; i++)
+        if (graph)
         {
-            trainClasses.at<float>(i, trainLabels.at<int>(i)) = 1.f;
+            vector<Hnsw::Hit> hits;
+            graph->search(*this, query, K, hits);
+            indices.release();
+            for (size_t i=0; i<hits.size(); i++)
+                indices.push_back(hits[i].second);
+            return;
         }
+        Mat dists;
+        flann->knnSearch(query, indices, dists, K, cv::flann::SearchParams(checks));
+    }
 
-        return ann->train(tofloat(trainData), ml::ROW_SAMPLE, trainClasses);
+    //
+    // flann can only write its index to a file, so it gets embedded as a blob,
+    //   the features are needed to load it back.
+    //
+    bool save(Archive &ar) const
+    {
+        ar << "knn_algo" << algo;
+        ar << "features" << features;
+        if (graph)
+            return graph->save(ar);
+        if (algo == KNN_LINEAR || !flann)
+            return true;
+
+        String fn = tempfile(".flann");
+        flann->save(fn);
+        ifstream in(fn.c_str(), ios::binary);
+        vector<uchar> blob((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        in.close();
+        std::remove(fn.c_str());
+        ar << "knn_flann" << Mat(blob);
+        return ! blob.empty();
     }
 
-    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    bool load(const Archive &ar)
     {
-        float r = ann->predict(tofloat(testFeature),results);
-        results = (Mat_<float>(1,1) << r);
-        return 1;
+        ar["knn_algo"] >> algo;
+        ar["features"] >> features;
+        if (features.empty())
+            return false;
+        flann.release();
+        graph.release();
+        if (algo == KNN_HNSW)
+        {
+            graph = makePtr<Hnsw>(M, efc, ef);
+            if (graph->load(ar) && graph->size() == features.rows)
+                return true;
+        }
+
+        Mat blob;
+        ar["knn_flann"] >> blob;
+        if (! blob.empty())
+        {
+            String fn = tempfile(".flann");
+            ofstream out(fn.c_str(), ios::binary);
+            out.write((const char*)blob.ptr(), blob.total());
+            out.close();
+            flann = makePtr<cv::flann::Index>();
+            bool ok = flann->load(features, fn);
+            std::remove(fn.c_str());
+            if (ok)
+                return true;
+        }
+        build(features); // linear, or something went wrong
+        return true;
     }
 };
 
 
 struct ClassifierKNN : Classifier
 {
-    cv::Ptr<cv::flann::Index> index;
+    KnnIndex index;
     Mat_<int> labels;
+    int K;
+
+    ClassifierKNN(int algo=KnnIndex::KNN_LINEAR, int K=5, int M=16, int efc=200, int ef=64)
+        : index(algo, 4, 32, 64, M, efc, ef)
+        , K(K)
+    {}
 
-    static int majority(const Mat_<int> &ind, const Mat_<int> &labels) // re-used in verifier
+    static int majority(const Mat_<int> &ind, const Mat_<int> &labels)
     {
         map<int,int> maj;
         for (size_t i=0; i<ind.total(); i++)
         {
-            int id = labels(ind(i));
+            if (ind(int(i)) < 0) // lsh leaves the slots it could not fill at -1
+                continue;
+            int id = labels(ind(int(i)));
             if (maj.find(id) == maj.end())
                 maj[id] = 0;
             maj[id] ++;
         }
         int maxv=0;
-        int maxi=0;
+        int maxi=-1; // no neighbour at all
         map<int,int>::iterator it = maj.begin();
         for (; it != maj.end(); it++)
         {
@@ -532,34 +3836,44 @@ struct ClassifierKNN : Classifier
         return maxi;
     }
 
-    static cv::Ptr<cv::flann::Index> train_index(const Mat &trainData)
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
-        if (trainData.type() == CV_8U)
-        {
-            return makePtr<cv::flann::Index>(trainData, cv::flann::LinearIndexParams(), cvflann::FLANN_DIST_HAMMING);
-        }
-        return makePtr<cv::flann::Index>(trainData, cv::flann::LinearIndexParams(), cvflann::FLANN_DIST_L2);
+        index.build(trainData);
+        labels = trainLabels;
+        return 1;
     }
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
     {
-        index  = train_index(trainData);
-        labels = trainLabels;
+        index.add(trainData);
+        labels.push_back(Mat_<int>(trainLabels.reshape(1, int(trainLabels.total()))));
         return 1;
     }
 
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
     {
-        int K=5;
-        cv::flann::SearchParams params;
-        cv::Mat dists;
-        cv::Mat indices;
-        index->knnSearch(testFeature, indices, dists, K, params);
+        Mat_<int> indices;
+        index.knn(testFeature, K, indices);
 
         results = (Mat_<float>(1,1) << majority(indices, labels));
         //results = (Mat_<float>(1,1) << labels(indices.at<int>(0)));
         return 1;
     }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "labels" << labels;
+        ar << "K" << K;
+        return index.save(ar);
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        ar["labels"] >> labels;
+        ar["K"] >> K;
+        return index.load(ar);
+    }
 };
 
 //------->8-----------------------------------------------------------------------
@@ -577,7 +3891,7 @@ struct ClassifierKNN : Classifier
 //
 struct VerifierNearest : TextureFeature::Verifier
 {
-    double thresh;
+    double thresh; // on the distance
     int flag;
 
     VerifierNearest(int f=NORM_L2)
@@ -621,6 +3935,62 @@ struct VerifierNearest : TextureFeature::Verifier
     {
         return (distance(a,b) < thresh);
     }
+
+    // the negative distance, so higher means more alike
+    virtual double score(const Mat &a, const Mat &b) const
+    {
+        return -distance(a,b);
+    }
+
+    struct Scorer : public ParallelLoopBody
+    {
+        const VerifierNearest &ver;
+        const Mat &A, &B;
+        Mat &scores;
+
+        Scorer(const VerifierNearest &ver, const Mat &A, const Mat &B, Mat &scores) : ver(ver), A(A), B(B), scores(scores) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+                scores.at<float>(i) = float(ver.score(A.row(i), B.row(i)));
+        }
+    };
+
+    virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+    {
+        CV_Assert(A.size() == B.size() && A.type() == B.type());
+        scores.create(A.rows, 1, CV_32F);
+        parallel_for_(Range(0, A.rows), Scorer(*this, A, B, scores));
+        return scores.rows;
+    }
+
+    virtual double threshold() const
+    {
+        return -thresh;
+    }
+
+    virtual void setThreshold(double t)
+    {
+        thresh = -t;
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "thresh" << thresh;
+        ar << "flag" << flag;
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        if (ar["thresh"].empty())
+            return false;
+        ar["thresh"] >> thresh;
+        ar["flag"] >> flag;
+        return true;
+    }
 };
 
 //
@@ -634,7 +4004,8 @@ struct VerifierHist : VerifierNearest
 
     virtual double distance(const Mat &a, const Mat &b) const
     {
-        return compareHist(tofloat(a),tofloat(b),flag);
+        Mat fa = floatrow(a), fb = floatrow(b);
+        return hist_pair(flag, fa.ptr<float>(), fb.ptr<float>(), fa.cols);
     }
 };
 
@@ -649,6 +4020,22 @@ struct VerifierCosine : VerifierNearest
     }
 };
 
+//
+// binary descriptors, the number of differing bits
+//
+struct VerifierHamming : VerifierNearest
+{
+    VerifierHamming()
+        : VerifierNearest(NORM_HAMMING)
+    {}
+
+    virtual double distance(const Mat &a, const Mat &b) const
+    {
+        Mat ca = ClassifierHamming::code(a), cb = ClassifierHamming::code(b);
+        return hamming(ca.ptr(), cb.ptr(), ca.cols);
+    }
+};
+
 
 
 //
@@ -657,8 +4044,14 @@ struct VerifierCosine : VerifierNearest
 //
 struct PairDistance
 {
+    int block; // bytes per landmark of a binary descriptor (LATCH2: 96)
+
+    PairDistance(int block=96) : block(block) {}
+
     //
-    // xor for binary, L2 for float
+    // binary: the hamming distance per block of bytes (one per landmark), if the rows split evenly,
+    //   else xor, L2 for float
+    //   (all opencv matrix ops, so a block of pairs goes through at once)
     //
     Mat distance_mat(const Mat &a, const Mat &b) const
     {
@@ -666,6 +4059,19 @@ struct PairDistance
         switch(a.type())
         {
             case CV_8U:
+                if (block > 0 && a.cols % block == 0)
+                {
+                    int nb = a.cols / block;
+                    d.create(a.rows, nb, CV_32F);
+                    for (int r=0; r<a.rows; r++)
+                    {
+                        const uchar *pa = a.ptr(r), *pb = b.ptr(r);
+                        float *pd = d.ptr<float>(r);
+                        for (int j=0; j<nb; j++)
+                            pd[j] = float(hamming(pa + j*block, pb + j*block, block));
+                    }
+                    break;
+                }
                 d = a^b;
                 d.convertTo(d,CV_32F);
                 break;
@@ -678,19 +4084,49 @@ struct PairDistance
         return d;
     }
 
+    struct Distances : public ParallelLoopBody
+    {
+        const PairDistance &pd;
+        const Mat &A, &B;
+        Mat &D;
+
+        Distances(const PairDistance &pd, const Mat &A, const Mat &B, Mat &D) : pd(pd), A(A), B(B), D(D) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            Mat d = pd.distance_mat(A.rowRange(range.start, range.end), B.rowRange(range.start, range.end));
+            d.copyTo(D.rowRange(range.start, range.end));
+        }
+    };
+
+    // one pair per row of A and B, in blocks of rows over the threads
+    Mat distance_batch(const Mat &A, const Mat &B) const
+    {
+        CV_Assert(A.size() == B.size() && A.type() == B.type());
+        if (A.rows < 1)
+            return Mat();
+        Mat d0 = distance_mat(A.row(0), B.row(0));
+        Mat D(A.rows, d0.cols, d0.type());
+        parallel_for_(Range(0, A.rows), Distances(*this, A, B, D), std::max(A.rows / 64, 1));
+        return D;
+    }
+
     //
     // make a 'distance' mat from 2 features,
     // and binary(-1,1) labels
     //
     void train_pre(const Mat &features, const Mat &labels, Mat &distances, Mat &binlabels)
     {
-        for (size_t i=0; i<labels.total()-1; i+=2)
+        int n = int(labels.total()) / 2;
+        if (n < 1)
+            return;
+        // the even and the odd rows, without a copy
+        Mat A(n, features.cols, features.type(), (void*)features.ptr(0), features.step[0]*2);
+        Mat B(n, features.cols, features.type(), (void*)features.ptr(1), features.step[0]*2);
+        distances.push_back(distance_batch(A, B));
+        for (int i=0; i<n; i++)
         {
-            int j = i+1;
-            Mat d = distance_mat(features.row(i), features.row(j));
-            distances.push_back(d);
-
-            int l = (labels.at<int>(i) == labels.at<int>(j)) ? 1 : -1;
+            int l = (labels.at<int>(2*i) == labels.at<int>(2*i+1)) ? 1 : -1;
             binlabels.push_back(l);
         }
     }
@@ -716,10 +4152,51 @@ struct VerifierPairDistance : public TextureFeature::Verifier, PairDistance
     }
 
     virtual bool same(const Mat &a, const Mat &b) const
+    {
+        return score(a, b) > thresh;
+    }
+
+    // the model's response
+    virtual double score(const Mat &a, const Mat &b) const
     {
         Mat res;
-        model->predict(distance_mat(a, b), res);
-        return (res.at<float>(0) > thresh);
+        scoreBatch(a, b, res);
+        return res.at<float>(0);
+    }
+
+    // opencv's models run a batch through their own parallel loops (svm) or a gemm (mlp)
+    virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+    {
+        Mat res;
+        model->predict(distance_batch(A, B), res);
+        res.col(0).convertTo(scores, CV_32F);
+        return scores.rows;
+    }
+
+    virtual double threshold() const
+    {
+        return thresh;
+    }
+
+    virtual void setThreshold(double t)
+    {
+        thresh = float(t);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        if (model.empty() || !model->isTrained())
+            return false;
+        ar << "thresh" << thresh;
+        saveModel(ar, "model", *model);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        ar["thresh"] >> thresh;
+        return !model.empty() && loadModel(ar, "model", *model);
     }
 };
 
@@ -727,11 +4204,18 @@ struct VerifierPairDistance : public TextureFeature::Verifier, PairDistance
 //
 // binary (2 class) svm, same or not same based on distance
 //
+//   after training, the decision function is taken out of the svm (see LinearSvm, ReducedSvm),
+//   so the score is its (negated) value, and a batch of pairs is a gemm, or a parallel kernel loop.
+//
 struct VerifierSVM : public VerifierPairDistance
 {
     Ptr<ml::SVM::Kernel> krnl;
+    LinearSvm linear;   // the linear kernel, collapsed
+    ReducedSvm reduced; // any other kernel, all support vectors, or a reduced set
+    int budget;         // reduced set vectors, 0: keep the support vectors
 
-    VerifierSVM(int ktype=ml::SVM::LINEAR)
+    VerifierSVM(int ktype=ml::SVM::LINEAR, int budget=0)
+        : budget(budget)
     {
         Ptr<ml::SVM> svm = ml::SVM::create();
         svm->setType(ml::SVM::NU_SVC);
@@ -749,38 +4233,173 @@ struct VerifierSVM : public VerifierPairDistance
         svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
         model = svm;
     }
+
+    virtual int train(const Mat &features, const Mat &labels)
+    {
+        Mat distances, binlabels;
+        train_pre(features, labels, distances, binlabels);
+
+        model->clear();
+        linear.clear();
+        reduced.clear();
+        int ok = model->train(ml::TrainData::create(distances, ml::ROW_SAMPLE, binlabels));
+        Ptr<ml::SVM> svm = model.dynamicCast<ml::SVM>();
+        if (ok && svm->getKernelType() == ml::SVM::LINEAR)
+            linear.build(*svm, binlabels);
+        else if (ok)
+            reduced.build(*svm, krnl, binlabels, budget > 0 ? budget : INT_MAX);
+        return ok;
+    }
+
+    virtual String info() const
+    {
+        if (reduced.empty())
+            return "";
+        return format("%d vectors, reduced set error %.4f", reduced.Z.rows, reduced.error());
+    }
+
+    //
+    // classes are (-1,1), and the single pair votes for the 1st (notSame), if its value is > 0,
+    //   so same() is (score > 0), like the svm's label was before.
+    //
+    virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+    {
+        Mat dec, D = distance_batch(A, B);
+        if (! linear.empty())
+            linear.decision(D, dec);
+        else if (! reduced.empty())
+            reduced.decision(D, dec);
+        else
+            return VerifierPairDistance::scoreBatch(A, B, scores);
+        dec.col(0).convertTo(scores, CV_32F, -1);
+        return scores.rows;
+    }
+
+    virtual bool save(Archive &ar) const
+    {
+        ar << "thresh" << thresh;
+        if (! linear.empty())
+            linear.save(ar);
+        else if (! reduced.empty())
+            reduced.save(ar);
+        else
+            return VerifierPairDistance::save(ar);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        ar["thresh"] >> thresh;
+        if (linear.load(ar))
+            return true;
+        if (reduced.load(ar, krnl))
+            return true;
+        return VerifierPairDistance::load(ar);
+    }
 };
 
 
 
+//
+// the score is the mean label (-1,1) of the K nearest training pairs
+//
 struct VerifierKNN : public TextureFeature::Verifier, PairDistance
 {
-    cv::Ptr<cv::flann::Index> index;
+    KnnIndex index; // keeps the distances, because flann tries to run away with mat.data pointer !!!
     Mat_<int> labels;
-    Mat features;
+    int K;
+    float thresh;
+
+    VerifierKNN(int algo=KnnIndex::KNN_LINEAR, int K=5, int M=16, int efc=200, int ef=64)
+        : index(algo, 4, 32, 64, M, efc, ef)
+        , K(K)
+        , thresh(0)
+    {}
 
     virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
         Mat distances, binlabels;
         train_pre(trainData, trainLabels, distances, binlabels);
 
-        index = ClassifierKNN::train_index(distances);
-
+        index.build(distances);
         labels = binlabels;
-        features = distances; // need a copy here, because flann tries to run away with mat.data pointer !!!
         return 1;
     }
 
     virtual bool same(const Mat &a, const Mat &b) const
     {
-        int K=5;
-        cv::flann::SearchParams params;
-        cv::Mat dists;
-        cv::Mat indices;
-        index->knnSearch(distance_mat(a,b), indices, dists, K, params);
+        return score(a, b) > thresh;
+    }
+
+    float neighbourScore(const Mat &d) const
+    {
+        Mat_<int> indices;
+        index.knn(d, K, indices);
+        double s = 0;
+        int n = 0;
+        for (size_t i=0; i<indices.total(); i++)
+        {
+            if (indices(int(i)) < 0)
+                continue;
+            s += labels(indices(int(i)));
+            n ++;
+        }
+        return n ? float(s / n) : -1.0f;
+    }
+
+    virtual double score(const Mat &a, const Mat &b) const
+    {
+        return neighbourScore(distance_mat(a, b));
+    }
+
+    struct Scorer : public ParallelLoopBody
+    {
+        const VerifierKNN &ver;
+        const Mat &D;
+        Mat &scores;
+
+        Scorer(const VerifierKNN &ver, const Mat &D, Mat &scores) : ver(ver), D(D), scores(scores) {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+                scores.at<float>(i) = ver.neighbourScore(D.row(i));
+        }
+    };
+
+    virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+    {
+        Mat D = distance_batch(A, B);
+        scores.create(A.rows, 1, CV_32F);
+        parallel_for_(Range(0, D.rows), Scorer(*this, D, scores));
+        return scores.rows;
+    }
+
+    virtual double threshold() const
+    {
+        return thresh;
+    }
+
+    virtual void setThreshold(double t)
+    {
+        thresh = float(t);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "labels" << labels;
+        ar << "K" << K;
+        ar << "thresh" << thresh;
+        return index.save(ar);
+    }
 
-        int hit = ClassifierKNN::majority(indices, labels);
-        return hit > 0;
+    virtual bool load(const Archive &ar)
+    {
+        ar["labels"] >> labels;
+        ar["K"] >> K;
+        ar["thresh"] >> thresh;
+        return index.load(ar);
     }
 };
 
@@ -806,9 +4425,69 @@ struct VerifierMLP : public VerifierPairDistance
 
         return model->train(ml::TrainData::create(distances, ml::ROW_SAMPLE, trainClasses));
     }
+
+    // the same-probability, on float features, like in training
+    virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+    {
+        return VerifierPairDistance::scoreBatch(tofloat(A), tofloat(B), scores);
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        model = ml::ANN_MLP::create(); // the topology comes with the model
+        return VerifierPairDistance::load(ar);
+    }
 };
 
 
+
+//
+// the tuning knobs for the factories, name=value pairs like "budget=200",
+//   separated by ',' or '+', same as a filter chain.
+//
+struct Options
+{
+    map<string, double> values;
+
+    static bool known(const string &name)
+    {
+        static const char *names[] = { "budget", "bins", "M", "efc", "ef", "pca", "oversample", "iters", 0 };
+        for (int i=0; names[i]; i++)
+            if (name == names[i])
+                return true;
+        return false;
+    }
+
+    Options(const String &opts)
+    {
+        string desc(opts);
+        size_t a = 0;
+        while (a < desc.size())
+        {
+            size_t b = desc.find_first_of("+,", a);
+            if (b == string::npos)
+                b = desc.size();
+            string kv = desc.substr(a, b-a);
+            a = b + 1;
+            if (kv.empty())
+                continue;
+            size_t e = kv.find('=');
+            if (e == string::npos || !known(kv.substr(0, e)))
+            {
+                cerr << "option " << kv << " is not supported." << endl;
+                exit(-1);
+            }
+            values[kv.substr(0, e)] = atof(kv.c_str() + e + 1);
+        }
+    }
+
+    int get(const string &name, int def) const
+    {
+        map<string, double>::const_iterator it = values.find(name);
+        return it == values.end() ? def : cvRound(it->second);
+    }
+};
+
 } // TextureFeatureImpl
 
 
@@ -816,8 +4495,21 @@ namespace TextureFeature
 {
 using namespace TextureFeatureImpl;
 
-Ptr<Classifier> createClassifier(int clsfy)
+// the svm's own defaults, only the budget and the table bins come from the options
+static Ptr<Classifier> svmClassifier(int kernel, int budget, int bins)
+{
+    Ptr<ClassifierSVM> svm = makePtr<ClassifierSVM>(kernel);
+    svm->budget = budget;
+    svm->iksvm.bins = bins;
+    return svm;
+}
+
+Ptr<Classifier> createClassifier(int clsfy, const String &opts)
 {
+    Options o(opts);
+    int budget = o.get("budget", 0), bins = o.get("bins", 0);
+    int M = o.get("M", 16), efc = o.get("efc", 200), ef = o.get("ef", 64);
+    int pca = o.get("pca", IncrementalPca::PCA_AUTO), over = o.get("oversample", 10), iters = o.get("iters", 2);
     switch(clsfy)
     {
         case CL_NORM_L2:   return makePtr<ClassifierNearest>(NORM_L2); break;
@@ -827,22 +4519,34 @@ Ptr<Classifier> createClassifier(int clsfy)
         case CL_HIST_CHI:  return makePtr<ClassifierHist>(HISTCMP_CHISQR); break;
         case CL_KLDIV:     return makePtr<ClassifierHist>(HISTCMP_KL_DIV); break;
         case CL_COSINE:    return makePtr<ClassifierCosine>(); break;
-        case CL_SVM_LIN:   return makePtr<ClassifierSVM>(int(cv::ml::SVM::LINEAR)); break;
-        case CL_SVM_RBF:   return makePtr<ClassifierSVM>(int(cv::ml::SVM::RBF)); break;
-        case CL_SVM_POL:   return makePtr<ClassifierSVM>(int(cv::ml::SVM::POLY)); break;
-        case CL_SVM_INT:   return makePtr<ClassifierSVM>(int(cv::ml::SVM::INTER)); break;
-        case CL_SVM_INT2:  return makePtr<ClassifierSVM>(-5); break;
-        case CL_SVM_HEL:   return makePtr<ClassifierSVM>(-1); break;
-        case CL_SVM_HELSQ: return makePtr<ClassifierSVM>(-2); break;
-        case CL_SVM_LOW:   return makePtr<ClassifierSVM>(-6); break;
-        case CL_SVM_LOG:   return makePtr<ClassifierSVM>(-7); break;
-        case CL_SVM_KMOD:  return makePtr<ClassifierSVM>(-8); break;
-        case CL_SVM_CAUCHY:return makePtr<ClassifierSVM>(-9); break;
+        case CL_SVM_LIN:   return svmClassifier(int(cv::ml::SVM::LINEAR), budget, bins); break;
+        case CL_SVM_RBF:   return svmClassifier(int(cv::ml::SVM::RBF), budget, bins); break;
+        case CL_SVM_POL:   return svmClassifier(int(cv::ml::SVM::POLY), budget, bins); break;
+        case CL_SVM_INT:   return svmClassifier(int(cv::ml::SVM::INTER), budget, bins); break;
+        case CL_SVM_INT2:  return svmClassifier(-5, budget, bins); break;
+        case CL_SVM_HEL:   return svmClassifier(-1, budget, bins); break;
+        case CL_SVM_HELSQ: return svmClassifier(-2, budget, bins); break;
+        case CL_SVM_LOW:   return svmClassifier(-6, budget, bins); break;
+        case CL_SVM_LOG:   return svmClassifier(-7, budget, bins); break;
+        case CL_SVM_KMOD:  return svmClassifier(-8, budget, bins); break;
+        case CL_SVM_CAUCHY:return svmClassifier(-9, budget, bins); break;
         case CL_SVM_MULTI: return makePtr<ClassifierSvmMulti>(); break;
-        case CL_PCA:       return makePtr<ClassifierPCA>(); break;
-        case CL_PCA_LDA:   return makePtr<ClassifierPCA_LDA>(); break;
+        case CL_PCA:       return makePtr<ClassifierPCA>(0, pca, over, iters); break;
+        case CL_PCA_LDA:   return makePtr<ClassifierPCA_LDA>(0, true, pca, over, iters); break;
         case CL_MLP:       return makePtr<ClassifierMLP>(); break;
         case CL_KNN:       return makePtr<ClassifierKNN>(); break;
+        case CL_ANN_L2:    return makePtr<ClassifierNearest>(NORM_L2, true, M, efc, ef); break;
+        case CL_ANN_L1:    return makePtr<ClassifierNearest>(NORM_L1, true, M, efc, ef); break;
+        case CL_ANN_COS:   return makePtr<ClassifierCosine>(true, M, efc, ef); break;
+        case CL_ANN_HELL:  return makePtr<ClassifierHist>(HISTCMP_HELLINGER, true, M, efc, ef); break;
+        case CL_ANN_CHI:   return makePtr<ClassifierHist>(HISTCMP_CHISQR, true, M, efc, ef); break;
+        case CL_KNN_HNSW:  return makePtr<ClassifierKNN>(KnnIndex::KNN_HNSW, 5, M, efc, ef); break;
+        case CL_KNN_KDTREE:return makePtr<ClassifierKNN>(KnnIndex::KNN_KDTREE); break;
+        case CL_KNN_KMEANS:return makePtr<ClassifierKNN>(KnnIndex::KNN_KMEANS); break;
+        case CL_KNN_LSH:   return makePtr<ClassifierKNN>(KnnIndex::KNN_LSH); break;
+        case CL_LINEAR_SVM:return makePtr<ClassifierLinear>(ClassifierLinear::L2LOSS_SVM); break;
+        case CL_LINEAR_LR: return makePtr<ClassifierLinear>(ClassifierLinear::LOGISTIC); break;
+        case CL_HAMMING:   return makePtr<ClassifierHamming>(); break;
 
         default: cerr << "classification " << clsfy << " is not yet supported." << endl; exit(-1);
     }
@@ -850,8 +4554,11 @@ Ptr<Classifier> createClassifier(int clsfy)
 }
 
 
-Ptr<Verifier> createVerifier(int clsfy)
+Ptr<Verifier> createVerifier(int clsfy, const String &opts)
 {
+    Options o(opts);
+    int budget = o.get("budget", 0);
+    int M = o.get("M", 16), efc = o.get("efc", 200), ef = o.get("ef", 64);
     switch(clsfy)
     {
         case CL_NORM_L2:   return makePtr<VerifierNearest>(NORM_L2); break;
@@ -859,20 +4566,25 @@ Ptr<Verifier> createVerifier(int clsfy)
         case CL_NORM_L1:   return makePtr<VerifierNearest>(NORM_L1); break;
         case CL_HIST_HELL: return makePtr<VerifierHist>(HISTCMP_HELLINGER); break;
         case CL_HIST_CHI:  return makePtr<VerifierHist>(HISTCMP_CHISQR); break;
-        case CL_SVM_LIN:   return makePtr<VerifierSVM>(int(cv::ml::SVM::LINEAR)); break;
-        case CL_SVM_RBF:   return makePtr<VerifierSVM>(int(cv::ml::SVM::RBF)); break;
-        case CL_SVM_POL:   return makePtr<VerifierSVM>(int(cv::ml::SVM::POLY)); break;
-        case CL_SVM_INT:   return makePtr<VerifierSVM>(int(cv::ml::SVM::INTER)); break;
-        case CL_SVM_INT2:  return makePtr<VerifierSVM>(-5); break;
-        case CL_SVM_HEL:   return makePtr<VerifierSVM>(-1); break;
-        case CL_SVM_HELSQ: return makePtr<VerifierSVM>(-2); break;
-        case CL_SVM_LOW:   return makePtr<VerifierSVM>(-6); break;
-        case CL_SVM_LOG:   return makePtr<VerifierSVM>(-7); break;
-        case CL_SVM_KMOD:  return makePtr<VerifierSVM>(-8); break;
-        case CL_SVM_CAUCHY:return makePtr<VerifierSVM>(-9); break;
+        case CL_SVM_LIN:   return makePtr<VerifierSVM>(int(cv::ml::SVM::LINEAR), budget); break;
+        case CL_SVM_RBF:   return makePtr<VerifierSVM>(int(cv::ml::SVM::RBF), budget); break;
+        case CL_SVM_POL:   return makePtr<VerifierSVM>(int(cv::ml::SVM::POLY), budget); break;
+        case CL_SVM_INT:   return makePtr<VerifierSVM>(int(cv::ml::SVM::INTER), budget); break;
+        case CL_SVM_INT2:  return makePtr<VerifierSVM>(-5, budget); break;
+        case CL_SVM_HEL:   return makePtr<VerifierSVM>(-1, budget); break;
+        case CL_SVM_HELSQ: return makePtr<VerifierSVM>(-2, budget); break;
+        case CL_SVM_LOW:   return makePtr<VerifierSVM>(-6, budget); break;
+        case CL_SVM_LOG:   return makePtr<VerifierSVM>(-7, budget); break;
+        case CL_SVM_KMOD:  return makePtr<VerifierSVM>(-8, budget); break;
+        case CL_SVM_CAUCHY:return makePtr<VerifierSVM>(-9, budget); break;
         case CL_COSINE:    return makePtr<VerifierCosine>(); break;
         case CL_KNN:       return makePtr<VerifierKNN>(); break;
+        case CL_KNN_HNSW:  return makePtr<VerifierKNN>(KnnIndex::KNN_HNSW, 5, M, efc, ef); break;
+        case CL_KNN_KDTREE:return makePtr<VerifierKNN>(KnnIndex::KNN_KDTREE); break;
+        case CL_KNN_KMEANS:return makePtr<VerifierKNN>(KnnIndex::KNN_KMEANS); break;
+        case CL_KNN_LSH:   return makePtr<VerifierKNN>(KnnIndex::KNN_LSH); break;
         case CL_MLP:       return makePtr<VerifierMLP>(); break;
+        case CL_HAMMING:   return makePtr<VerifierHamming>(); break;
 
         default: cerr << "verification " << clsfy << " is not yet supported." << endl; exit(-1);
     }
@@ -245,22 +245,31 @@ double runtest(string name, Ptr<Extractor> ext, Ptr<Filter> fil, Ptr<Classifier>
         Mat trainFeatures, trainLabels;
         Mat testFeatures,  testLabels;
 
-        fsiz = crossfoldData(ext,fil,trainFeatures,trainLabels,testFeatures,testLabels,images,labels,persons,f,fold);
+        fsiz = crossfoldData(ext,Ptr<Filter>(),trainFeatures,trainLabels,testFeatures,testLabels,images,labels,persons,f,fold);
         trainFeatures = trainFeatures.reshape(1, trainLabels.rows);
 
+        // filters may need training, so they're applied after the split
+        if (!fil.empty())
+        {
+            fil->train(trainFeatures, trainLabels);
+            fil->filterBatch(trainFeatures, trainFeatures);
+            if (!testFeatures.empty())
+                fil->filterBatch(testFeatures.reshape(1, testLabels.rows), testFeatures);
+            fsiz = trainFeatures.cols * trainFeatures.elemSize();
+        }
+
         int64 t0 = cv::getTickCount();
         cls->train(trainFeatures, trainLabels);
         t_train += (getTickCount() - t0);
 
         int64 t1=getTickCount();
         Mat conf = Mat::zeros(confusion.size(), CV_32F);
-        for (int i=0; i<testFeatures.rows; i++)
+        Mat res;
+        if (!testFeatures.empty())
+            cls->predictBatch(testFeatures.reshape(1, testLabels.rows), 1, res);
+        for (int i=0; i<res.rows; i++)
         {
-            Mat res;
-            Mat feat = testFeatures.row(i);
-            cls->predict(feat.reshape(1,1), res);
-
-            int pred = int(res.at<float>(0));
+            int pred = int(res.at<float>(i, 0));
             int ground = testLabels.at<int>(i);
             if (pred<0 || ground<0)
             {
@@ -284,21 +293,28 @@ double runtest(string name, Ptr<Extractor> ext, Ptr<Filter> fil, Ptr<Classifier>
     double neg = all - sum(confusion.diag())[0];
     double err = double(neg)/all;
     cout << format("%-28s %6d %6d %6d %8.3f %8.3f %8.3f",name.c_str(), fsiz, int(all-neg), int(neg), (1.0-err), ct(t_train)/fold, ct(t_test)/fold) << endl;
+    String info = cls->info();
+    if (! info.empty()) cout << "  " << info << endl;
     if (debug) cout << "confusion" << endl << confusion(Range(0,min(20,confusion.rows)), Range(0,min(20,confusion.cols))) << endl;
     return err;
 }
 
-double runtest(int ext, int fil, int cls, const vector<Mat> &images, const vector<int> &labels, const vector< vector<int> > &persons, size_t fold=10)
+double runtest(int ext, const String &fil, int cls, const vector<Mat> &images, const vector<int> &labels, const vector< vector<int> > &persons, size_t fold=10, const String &opts="")
 {
-    string name = format( "%-8s %-6s %-9s", TextureFeature::EXS[ext], TextureFeature::FILS[fil], TextureFeature::CLS[cls]);
+    string name = format( "%-8s %-6s %-9s", TextureFeature::EXS[ext], fil.c_str(), TextureFeature::CLS[cls]);
     runtest(name,
         TextureFeature::createExtractor(ext),
         TextureFeature::createFilter(fil),
-        TextureFeature::createClassifier(cls),
+        TextureFeature::createClassifier(cls, opts),
         images,labels,persons, fold);
     return 0;
 }
 
+double runtest(int ext, int fil, int cls, const vector<Mat> &images, const vector<int> &labels, const vector< vector<int> > &persons, size_t fold=10)
+{
+    return runtest(ext, String(TextureFeature::FILS[fil]), cls, images, labels, persons, fold);
+}
+
 
 void printOptions()
 {
@@ -323,8 +339,9 @@ int main(int argc, const char *argv[])
             "{ maxp M         |10    | maximal img count per person (-1==read_all)}"
             "{ maxim I        |500   | maximal img count overall }"
             "{ ext e          |0    | extractor  enum }"
-            "{ fil f          |0     | filter   enum }"
+            "{ fil f          |0     | filter   enum, name, or chain like HELL+DCT8 }"
             "{ cls c          |20     | classifier enum }"
+            "{ copt O         |      | classifier options, like budget=200 or M=24,ef=128 }"
             "{ all a          |false | run a hardcoded list of tests }"
             "{ pre P          |3     | preprocessing }"
             "{ crop C         |80    | crop outer pixels }"
@@ -348,8 +365,9 @@ int main(int argc, const char *argv[])
     int all = parser.has("all");
     int tab = parser.has("tab");
     int ext = parser.get<int>("ext");
-    int fil = parser.get<int>("fil");
+    String fil = parser.get<String>("fil");
     int cls = parser.get<int>("cls");
+    String copt = parser.get<String>("copt");
     int pre = parser.get<int>("pre");
     int crp = parser.get<int>("crop");
     int fold = parser.get<int>("fold");
@@ -383,7 +401,7 @@ int main(int argc, const char *argv[])
 
     if ( ! all )
     {
-        runtest(ext, fil, cls, images, labels, persons, fold);
+        runtest(ext, fil, cls, images, labels, persons, fold, copt);
     }
     else
     {
@@ -399,6 +417,7 @@ int main(int argc, const char *argv[])
             TextureFeature::EXT_COMB_P,  TextureFeature::FIL_HELL,  TextureFeature::CL_SVM_INT2,
             TextureFeature::EXT_TPLBP_P, TextureFeature::FIL_DCT8,  TextureFeature::CL_SVM_INT2,
             TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_NONE,  TextureFeature::CL_SVM_INT2,
+            TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_KMAP_INT,  TextureFeature::CL_SVM_LIN,
             TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_NONE,  TextureFeature::CL_MLP,
             TextureFeature::EXT_HDGRAD, TextureFeature::FIL_DCT24,  TextureFeature::CL_SVM_LIN, 
             TextureFeature::EXT_HDLBP,  TextureFeature::FIL_DCT24,  TextureFeature::CL_SVM_INT2,
@@ -1,9 +1,11 @@
 #include <opencv2/imgproc.hpp>
+#include <opencv2/ml.hpp>
 using namespace cv;
 
 #include "texturefeature.h"
 
 #include <iostream>
+#include <map>
 using namespace std;
 
 using namespace TextureFeature;
@@ -75,6 +77,21 @@ struct FilterDct : public Filter
         dft(h3, dest, DCT_INVERSE | DFT_SCALE | DFT_ROWS);
         return 0;
     }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        Mat h; src.convertTo(h, CV_32F);
+        Mat h2(h.size(), h.type());
+
+        dft(h, h2, DFT_ROWS);
+
+        Mat h3 = (keep>0) ?
+                 h2.colRange(0, std::min(keep, h2.cols-1)) :
+                 h2;
+
+        dft(h3, dest, DCT_INVERSE | DFT_SCALE | DFT_ROWS);
+        return dest.rows;
+    }
 };
 
 
@@ -111,51 +128,473 @@ struct FilterRandomProjection : public Filter
         dest = s * proj;
         return 0;
     }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        filter(src, dest); // one feature per row already works
+        return dest.rows;
+    }
 };
 
 
 
 //
-// hellinger kernel (no reduction)
+// elementwise filters (no reduction), working in place on a float row,
+//   so a FilterChain can run several of them in one sweep.
 //
-struct FilterHellinger : public Filter
+struct FilterInplace : public Filter
 {
+    virtual void apply(float *p, int n) const = 0;
+
     virtual int filter(const Mat &src, Mat &dest) const
     {
-        src.convertTo(dest, CV_32F);
-        float eps = 1e-7f;
-        dest /= (sum(dest)[0] + eps); // L1
-        sqrt(dest,dest);
-        dest /= (norm(dest) + eps); // L2
+        Mat h; src.convertTo(h, CV_32F);
+        apply(h.ptr<float>(), int(h.total()));
+        dest = h;
         return 0;
     }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        Mat h; src.convertTo(h, CV_32F);
+        for (int i=0; i<h.rows; i++)
+            apply(h.ptr<float>(i), h.cols);
+        dest = h;
+        return dest.rows;
+    }
+};
+
+//
+// hellinger kernel (no reduction)
+//
+struct FilterHellinger : public FilterInplace
+{
+    virtual void apply(float *p, int n) const
+    {
+        const double eps = 1e-7;
+        double s = 0;
+        for (int i=0; i<n; i++)
+            s += p[i];
+        float a = float(1.0 / (s + eps)); // L1
+        double q = 0;
+        for (int i=0; i<n; i++)
+        {
+            p[i] = std::sqrt(p[i] * a);
+            q += double(p[i]) * p[i];
+        }
+        float b = float(1.0 / (std::sqrt(q) + eps)); // L2
+        for (int i=0; i<n; i++)
+            p[i] *= b;
+    }
 };
 
 //
 // pow(n,p) (no reduction) (-> generalized intersection)
 //
-struct FilterPow : public Filter
+struct FilterPow : public FilterInplace
 {
     double P;
     FilterPow(double p=0.25) : P(p) {}
+    virtual void apply(float *p, int n) const
+    {
+        float fp = float(P);
+        for (int i=0; i<n; i++)
+            p[i] = std::pow(std::abs(p[i]), fp); // same as cv::pow for non-integer P
+    }
+};
+
+
+//
+// Vedaldi, Zisserman: "Efficient Additive Kernels via Explicit Feature Maps"
+//   maps each bin to 2*order+1 dims, so a linear svm on the output
+//   approximates the chi2 / intersection / hellinger kernel svm.
+//
+struct FilterKernelMap : public Filter
+{
+    enum { KM_CHI2, KM_INTER, KM_HELL };
+    int kernel;
+    int order;
+    double L;    // sampling period
+    vector<float> coef;
+
+    FilterKernelMap(int kernel=KM_CHI2, int order=2, double L=0.5)
+        : kernel(kernel)
+        , order(kernel==KM_HELL ? 0 : order) // hellinger is exact at order 0
+        , L(L)
+    {
+        // spectrum of the kernel signature, sampled at j*L
+        for (int j=0; j<=this->order; j++)
+        {
+            double lambda = j * L;
+            double kappa = 1.0;
+            switch(kernel)
+            {
+                case KM_CHI2:  kappa = 1.0 / cosh(CV_PI * lambda); break;
+                case KM_INTER: kappa = 2.0 / (CV_PI * (1.0 + 4.0 * lambda * lambda)); break;
+                case KM_HELL:  kappa = 1.0; break;
+            }
+            double c = (j==0) ? (kernel==KM_HELL ? 1.0 : L * kappa) : 2.0 * L * kappa;
+            coef.push_back(float(std::sqrt(c)));
+        }
+    }
+
     virtual int filter(const Mat &src, Mat &dest) const
     {
-        src.convertTo(dest, CV_32F);
-        cv::pow(dest,P,dest);
+        Mat h; src.convertTo(h, CV_32F);
+        h = h.reshape(1,1);
+        int M = 2*order + 1;
+        Mat res(1, h.cols * M, CV_32F);
+        const float *in = h.ptr<float>();
+        float *out = res.ptr<float>();
+        for (int i=0; i<h.cols; i++, out+=M)
+        {
+            float x = in[i];
+            if (x == 0)
+            {
+                std::fill(out, out+M, 0.0f);
+                continue;
+            }
+            float sgn = x<0 ? -1.0f : 1.0f; // keep the sign, like vlfeat does
+            float ax  = std::abs(x);
+            float sx  = std::sqrt(ax);
+            float lx  = std::log(ax);
+            out[0] = sgn * sx * coef[0];
+            for (int j=1; j<=order; j++)
+            {
+                float a = float(j * L) * lx;
+                out[2*j-1] = sgn * sx * coef[j] * std::cos(a);
+                out[2*j]   = sgn * sx * coef[j] * std::sin(a);
+            }
+        }
+        dest = res;
         return 0;
     }
 };
 
 
-struct FilterMeanStdev : public Filter
+// outsourced to svmkernel.cpp
+extern Ptr<ml::SVM::Kernel> customKernel(int id);
+
+//
+// Williams, Seeger: "Using the Nystroem Method to Speed Up Kernel Machines"
+//   approximate feature map for the (non-additive) custom svm kernels,
+//   phi(x) = k(x,landmarks) * U * S^-1/2, where K_mm = U*S*U'
+//
+struct FilterNystroem : public Filter
 {
+    int kid;        // customKernel id
+    int K;          // max number of landmarks
+    Ptr<ml::SVM::Kernel> krnl;
+    Mat landmarks;  // sampled train features, one per row
+    Mat proj;
+
+    FilterNystroem(int kid=-10, int K=1000)
+        : kid(kid)
+        , K(K)
+        , krnl(customKernel(kid))
+    {}
+
+    void kernelRows(const Mat &data, Mat &C) const
+    {
+        C.create(data.rows, landmarks.rows, CV_32F);
+        for (int i=0; i<data.rows; i++)
+        {
+            krnl->calc(landmarks.rows, landmarks.cols, landmarks.ptr<float>(), data.ptr<float>(i), C.ptr<float>(i));
+        }
+    }
+
+    virtual int train(const Mat &features, const Mat &labels)
+    {
+        Mat data; features.reshape(1, labels.rows).convertTo(data, CV_32F);
+
+        // pick K random landmarks, fixed seed for repeatable folds
+        Mat_<int> idx(1, data.rows);
+        for (int i=0; i<data.rows; i++) idx(i) = i;
+        RNG rng(37183927);
+        randShuffle(idx, 1, &rng);
+        int M = std::min(K, data.rows);
+        landmarks.create(M, data.cols, CV_32F);
+        for (int i=0; i<M; i++)
+            data.row(idx(i)).copyTo(landmarks.row(i));
+
+        Mat Kmm;
+        kernelRows(landmarks, Kmm);
+        Kmm = (Kmm + Kmm.t()) * 0.5;
+
+        Mat evals, evecs;
+        eigen(Kmm, evals, evecs);
+
+        // drop the tiny (and the negative, for the cpd kernels) part of the spectrum
+        const float eps = 1e-6f * std::max(std::abs(evals.at<float>(0)), 1e-12f);
+        proj.release();
+        for (int j=0; j<evals.rows; j++)
+        {
+            float l = evals.at<float>(j);
+            if (l <= eps) break; // sorted descending
+            Mat p = evecs.row(j) / std::sqrt(l);
+            proj.push_back(p);
+        }
+        proj = proj.t();
+        return proj.cols;
+    }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        Mat data; src.convertTo(data, CV_32F);
+        Mat C;
+        kernelRows(data, C);
+        gemm(C, proj, 1.0, noArray(), 0.0, dest);
+        return dest.rows;
+    }
+
     virtual int filter(const Mat &src, Mat &dest) const
     {
-        Scalar m,s; 
-        meanStdDev(src, m, s);
-        dest  = src - m[0];
-        dest /= s[0];
-        return 0;
+        return filterBatch(src.reshape(1,1), dest);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "nystroem_kernel" << kid;
+        ar << "nystroem_landmarks" << landmarks;
+        ar << "nystroem_proj" << proj;
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        ar["nystroem_kernel"] >> kid;
+        ar["nystroem_landmarks"] >> landmarks;
+        ar["nystroem_proj"] >> proj;
+        krnl = customKernel(kid);
+        return ! proj.empty();
+    }
+};
+
+
+//
+// supervised feature selection, keeps the K best ranked dimensions.
+//   both criteria only need the per-class sums, accumulated one class at a time:
+//     A = sum_c(S_c^2/n_c), T = sum(x), Q = sum(x^2)
+//   fisher: between/within class variance = (A - T^2/N) / (Q - A)
+//   chi2  : sum_c (O_c-E_c)^2/E_c, E_c = T*n_c/N  =  A*N/T - T
+//
+struct FilterSelect : public Filter
+{
+    enum { SEL_FISHER, SEL_CHI2 };
+    int crit;
+    int K;
+    Mat_<int> index; // selected dims, sorted ascending, so the gather runs forward
+
+    FilterSelect(int crit=SEL_FISHER, int K=4000)
+        : crit(crit)
+        , K(K)
+    {}
+
+    virtual int train(const Mat &features, const Mat &labels)
+    {
+        Mat data; features.reshape(1, labels.rows).convertTo(data, CV_32F);
+        int N = data.rows, D = data.cols;
+
+        map< int, vector<int> > classes;
+        for (int i=0; i<N; i++)
+            classes[labels.at<int>(i)].push_back(i);
+
+        Mat_<double> A = Mat_<double>::zeros(1, D);
+        Mat_<double> T = Mat_<double>::zeros(1, D);
+        Mat_<double> Q = Mat_<double>::zeros(1, D);
+        Mat_<double> S(1, D);
+        map< int, vector<int> >::iterator it = classes.begin();
+        for (; it != classes.end(); ++it)
+        {
+            const vector<int> &rows = it->second;
+            S = 0.0;
+            for (size_t r=0; r<rows.size(); r++)
+            {
+                const float *x = data.ptr<float>(rows[r]);
+                for (int j=0; j<D; j++)
+                {
+                    S(j) += x[j];
+                    Q(j) += double(x[j]) * x[j];
+                }
+            }
+            double n = double(rows.size());
+            for (int j=0; j<D; j++)
+            {
+                A(j) += S(j) * S(j) / n;
+                T(j) += S(j);
+            }
+        }
+
+        Mat_<float> score(1, D);
+        for (int j=0; j<D; j++)
+        {
+            double sc = 0;
+            if (crit == SEL_FISHER)
+                sc = (A(j) - T(j)*T(j)/N) / (Q(j) - A(j) + 1e-7);
+            else if (T(j) > 0)
+                sc = A(j) * N / T(j) - T(j);
+            score(j) = float(sc);
+        }
+
+        Mat_<int> rank;
+        sortIdx(score, rank, SORT_EVERY_ROW + SORT_DESCENDING);
+        Mat_<int> best = rank.colRange(0, std::min(K, D));
+        cv::sort(best, index, SORT_EVERY_ROW + SORT_ASCENDING);
+        return index.cols;
+    }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        Mat data; src.convertTo(data, CV_32F);
+        Mat res(data.rows, index.cols, CV_32F);
+        const int *id = index[0];
+        for (int i=0; i<data.rows; i++)
+        {
+            const float *x = data.ptr<float>(i);
+            float *y = res.ptr<float>(i);
+            for (int j=0; j<index.cols; j++)
+                y[j] = x[id[j]];
+        }
+        dest = res;
+        return dest.rows;
+    }
+
+    virtual int filter(const Mat &src, Mat &dest) const
+    {
+        return filterBatch(src.reshape(1,1), dest);
+    }
+
+    // Serialize
+    virtual bool save(Archive &ar) const
+    {
+        ar << "select_crit" << crit;
+        ar << "select_index" << index;
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        ar["select_crit"] >> crit;
+        Mat idx; ar["select_index"] >> idx;
+        index = idx;
+        K = index.cols;
+        return ! index.empty();
+    }
+};
+
+
+struct FilterMeanStdev : public FilterInplace
+{
+    virtual void apply(float *p, int n) const
+    {
+        double s = 0, q = 0;
+        for (int i=0; i<n; i++)
+        {
+            s += p[i];
+            q += double(p[i]) * p[i];
+        }
+        double m = s / n;
+        double sd = std::sqrt(std::max(q / n - m * m, 0.0));
+        float a = float(1.0 / sd);
+        float b = float(m);
+        for (int i=0; i<n; i++)
+            p[i] = (p[i] - b) * a;
+    }
+};
+
+
+//
+// any sequence of filters, e.g. "HELL+DCT8".
+//   input is converted to float once, consecutive elementwise stages
+//   run in one sweep per row, all other stages run on the whole batch.
+//
+struct FilterChain : public Filter
+{
+    vector< Ptr<Filter> > stages;
+    String desc;
+
+    FilterChain(const vector< Ptr<Filter> > &stages, const String &desc)
+        : stages(stages)
+        , desc(desc)
+    {}
+
+    static const FilterInplace *inplace(const Ptr<Filter> &f)
+    {
+        return dynamic_cast<const FilterInplace*>(f.get());
+    }
+
+    int run(const Mat &src, Mat &dest, size_t from, size_t to) const
+    {
+        Mat data;
+        if (src.type() == CV_32F && from<to && !inplace(stages[from]))
+            data = src; // the first stage will copy anyway
+        else
+            src.convertTo(data, CV_32F);
+
+        for (size_t i=from; i<to; )
+        {
+            size_t j = i;
+            while (j<to && inplace(stages[j]))
+                j++;
+            if (j > i) // fused elementwise run
+            {
+                for (int r=0; r<data.rows; r++)
+                {
+                    float *p = data.ptr<float>(r);
+                    for (size_t k=i; k<j; k++)
+                        inplace(stages[k])->apply(p, data.cols);
+                }
+                i = j;
+                continue;
+            }
+            stages[i]->filterBatch(data, data);
+            if (data.type() != CV_32F)
+                data.convertTo(data, CV_32F);
+            i++;
+        }
+        dest = data;
+        return dest.rows;
+    }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        return run(src, dest, 0, stages.size());
+    }
+
+    virtual int filter(const Mat &src, Mat &dest) const
+    {
+        return run(src.reshape(1,1), dest, 0, stages.size());
+    }
+
+    virtual int train(const Mat &features, const Mat &labels)
+    {
+        // each stage learns from the output of the previous ones
+        Mat data = features.reshape(1, labels.rows);
+        int n = 0;
+        for (size_t i=0; i<stages.size(); i++)
+        {
+            n += stages[i]->train(data, labels);
+            if (i+1 < stages.size())
+                run(data, data, i, i+1);
+        }
+        return n;
+    }
+
+    // Serialize (a trainable filter type may appear only once in the chain)
+    virtual bool save(Archive &ar) const
+    {
+        ar << "chain" << desc;
+        for (size_t i=0; i<stages.size(); i++)
+            stages[i]->save(ar);
+        return true;
+    }
+
+    virtual bool load(const Archive &ar)
+    {
+        for (size_t i=0; i<stages.size(); i++)
+            stages[i]->load(ar);
+        return true;
     }
 };
 
@@ -189,10 +628,66 @@ Ptr<Filter> createFilter(int filt)
         case FIL_DCT12:    return makePtr<FilterDct>(12000); break;
         case FIL_DCT16:    return makePtr<FilterDct>(16000); break;
         case FIL_DCT24:    return makePtr<FilterDct>(24000); break;
+        case FIL_KMAP_CHI2:return makePtr<FilterKernelMap>(FilterKernelMap::KM_CHI2); break;
+        case FIL_KMAP_INT: return makePtr<FilterKernelMap>(FilterKernelMap::KM_INTER); break;
+        case FIL_KMAP_HELL:return makePtr<FilterKernelMap>(FilterKernelMap::KM_HELL); break;
+        case FIL_NYS_RBF:  return makePtr<FilterNystroem>(-10); break;
+        case FIL_NYS_LOG:  return makePtr<FilterNystroem>(-7); break;
+        case FIL_NYS_KMOD: return makePtr<FilterNystroem>(-8); break;
+        case FIL_NYS_CAUCHY:return makePtr<FilterNystroem>(-9); break;
+        case FIL_FISHER4:  return makePtr<FilterSelect>(FilterSelect::SEL_FISHER, 4000); break;
+        case FIL_FISHER8:  return makePtr<FilterSelect>(FilterSelect::SEL_FISHER, 8000); break;
+        case FIL_CHISEL4:  return makePtr<FilterSelect>(FilterSelect::SEL_CHI2, 4000); break;
+        case FIL_CHISEL8:  return makePtr<FilterSelect>(FilterSelect::SEL_CHI2, 8000); break;
 //        default: cerr << "Filter " << filt << " is not yet supported." << endl; exit(-1);
     }
     return Ptr<Filter>();
 }
 
+
+static int filterId(const string &name)
+{
+    if (name.find_first_not_of("0123456789") == string::npos)
+        return atoi(name.c_str());
+    for (int i=0; i<FIL_MAX; i++)
+    {
+        if (name == FILS[i])
+            return i;
+    }
+    return -1;
+}
+
+Ptr<Filter> createFilter(const String &chain)
+{
+    string desc(chain);
+    vector< Ptr<Filter> > stages;
+    size_t a = 0;
+    while (a < desc.size())
+    {
+        size_t b = desc.find_first_of("+,", a);
+        if (b == string::npos)
+            b = desc.size();
+        string name = desc.substr(a, b-a);
+        a = b + 1;
+        if (name.empty())
+            continue;
+
+        int id = filterId(name);
+        if (id < 0 || id >= FIL_MAX)
+        {
+            cerr << "Filter " << name << " is not yet supported." << endl;
+            exit(-1);
+        }
+        Ptr<Filter> f = createFilter(id);
+        if (! f.empty())
+            stages.push_back(f);
+    }
+    if (stages.empty())
+        return Ptr<Filter>();
+    if (stages.size() == 1)
+        return stages[0];
+    return makePtr<FilterChain>(stages, chain);
+}
+
 } // TextureFeatureImpl
 
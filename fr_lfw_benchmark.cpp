@@ -58,6 +58,7 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <set>
 
@@ -106,19 +107,21 @@ class MyFace
     Mat labels;
     Mat features;
     int nimg;
+    bool binary; // keep the packed bytes of a binary descriptor, the filters want floats
 
 public:
 
-    MyFace(int extract=0, int filt=0, int clsfy=0, int preproc=0, int crop=0, const String &train="dev",int skip=1, bool lab=false)
+    MyFace(int extract=0, const String &filt="none", int clsfy=0, int preproc=0, int crop=0, const String &train="dev",int skip=1, bool lab=false, const String &copt="")
         : pre(preproc,crop)
         , nimg(train=="dev"?((4400/skip)^0x1):(10800/skip)^0x01)
     {
         ext = TextureFeature::createExtractor(extract);
         fil = TextureFeature::createFilter(filt);
+        binary = (extract == TextureFeature::EXT_LATCH2) && fil.empty();
         if (lab)
-            cls = TextureFeature::createClassifier(clsfy);
+            cls = TextureFeature::createClassifier(clsfy, copt);
         else
-            ver = TextureFeature::createVerifier(clsfy);
+            ver = TextureFeature::createVerifier(clsfy, copt);
     }
 
     Mat extract(const Mat & a) const
@@ -126,7 +129,7 @@ public:
         Mat feat1;
         ext->extract(pre.process(a), feat1);
 
-        if (feat1.type() != CV_32F)
+        if (feat1.type() != CV_32F && !(binary && feat1.type() == CV_8U))
             feat1.convertTo(feat1,CV_32F);
         return feat1.reshape(1,1);
     }
@@ -134,10 +137,6 @@ public:
     virtual int addTraining(const Mat & img, int label)
     {
         Mat feat = extract(img);
-        if (! fil.empty())
-        {
-            fil->filter(feat,feat);
-        }
         if ( features.empty() )
         {
             features = Mat(nimg, feat.total(), feat.type());
@@ -152,39 +151,106 @@ public:
         //cerr << "\n." << features.cols << " ";
         //cerr << "start training." << " ";
         int ok = 0;
+        if (! fil.empty()) // filters may need training, so they're applied here
+        {
+            Mat raw = features.rowRange(0, labels.rows);
+            fil->train(raw, labels);
+            fil->filterBatch(raw, features);
+        }
         if (!cls.empty())
             ok = cls->train(features, labels.reshape(1,features.rows));
         if (!ver.empty())
             ok = ver->train(features, labels/*.reshape(1,features.rows)*/);
         //cerr << "done training." << endl;
         CV_Assert(ok);
+        String info = !cls.empty() ? cls->info() : ver->info();
+        if (! info.empty())
+            cerr << info << endl;
         features.release();
         labels.release();
         return ok!=0;
     }
-    virtual int same(const Mat & a, const Mat &b) const
+    // both images of a pair, extracted and filtered
+    void pair(const Mat & a, const Mat &b, Mat &feat1, Mat &feat2) const
     {
-        Mat feat1 = extract(a);
-        Mat feat2 = extract(b);
+        feat1 = extract(a);
+        feat2 = extract(b);
 
         if (! fil.empty())
         {
             fil->filter(feat1,feat1);
             fil->filter(feat2,feat2);
         }
+    }
+
+    // only verifiers have a continuous score
+    bool scores() const
+    {
+        return !ver.empty();
+    }
+    int scoreBatch(const Mat &A, const Mat &B, Mat &s) const
+    {
+        return ver->scoreBatch(A, B, s);
+    }
+    double threshold() const
+    {
+        return ver->threshold();
+    }
+
+    virtual int same(const Mat & a, const Mat &b) const
+    {
+        Mat feat1, feat2;
+        pair(a, b, feat1, feat2);
 
         if (!ver.empty())
             return ver->same(feat1,feat2);
 
-        Mat_<float> r1,r2;
-        cls->predict(feat1,r1);
-        cls->predict(feat2,r2);
-        //cerr << format("%4d %4d\t",int(r1(0)),int(r2(0)));
-        return int(r1(0)) == int(r2(0));
+        Mat both;
+        both.push_back(feat1.reshape(1,1));
+        both.push_back(feat2.reshape(1,1));
+        Mat_<float> r;
+        cls->predictBatch(both, 1, r);
+        //cerr << format("%4d %4d\t",int(r(0,0)),int(r(1,0)));
+        return int(r(0,0)) == int(r(1,0));
     }
 };
 
 
+//
+// area under the roc curve, the chance that a random same pair scores higher than a random notSame one.
+//   (mann-whitney, from the ranks, ties count half)
+//
+double rocAuc(const Mat_<float> &scores, const vector<int> &truth)
+{
+    vector< pair<float,int> > s;
+    for (size_t i=0; i<truth.size(); i++)
+        s.push_back(make_pair(scores(int(i)), truth[i]));
+    sort(s.begin(), s.end());
+
+    double rankSum = 0, npos = 0;
+    for (size_t i=0; i<s.size(); )
+    {
+        size_t j = i;
+        while (j<s.size() && s[j].first == s[i].first)
+            j++;
+        double rank = 0.5 * (i + j + 1); // mean (1 based) rank of the tie group
+        for (size_t k=i; k<j; k++)
+        {
+            if (s[k].second)
+            {
+                rankSum += rank;
+                npos ++;
+            }
+        }
+        i = j;
+    }
+    double nneg = double(s.size()) - npos;
+    if (npos == 0 || nneg == 0)
+        return 0;
+    return (rankSum - npos * (npos + 1) / 2) / (npos * nneg);
+}
+
+
 int main(int argc, const char *argv[])
 {
     PROFILE;
@@ -193,8 +259,9 @@ int main(int argc, const char *argv[])
             "{ opts o         |    | show extractor / filter / verifier options }"
             "{ path p         |data/lfw-deepfunneled/| path to dataset (lfw2 folder) }"
             "{ ext e          |27   | extractor enum }"
-            "{ fil f          |0   | filter enum }"
+            "{ fil f          |0   | filter enum, name, or chain like HELL+DCT8 }"
             "{ cls c          |21   | classifier enum }"
+            "{ copt O         |    | classifier options, like budget=200 or M=24,ef=128 }"
             "{ pre P          |0   | preprocessing }"
             "{ lab l          |0   | train / test with labels(instead of direct image compare) }"
             "{ skip s         |80  | skip imgs for train }"
@@ -215,16 +282,17 @@ int main(int argc, const char *argv[])
     }
     bool lab = parser.has("lab");
     int ext = parser.get<int>("ext");
-    int fil = parser.get<int>("fil");
+    String fil = parser.get<String>("fil");
     int cls = parser.get<int>("cls");
+    String copt = parser.get<String>("copt");
     int pre = parser.get<int>("pre");
     int crp = parser.get<int>("crop");
     int skip = parser.get<int>("skip");
     string trainMethod(parser.get<string>("train"));
-    cout << TextureFeature::EXS[ext] << " " << TextureFeature::FILS[fil] << " " << TextureFeature::CLS[cls] << " " << crp << " " << trainMethod << (lab?" c":" v") << endl;
+    cout << TextureFeature::EXS[ext] << " " << fil << " " << TextureFeature::CLS[cls] << " " << crp << " " << trainMethod << (lab?" c":" v") << endl;
 
     int64 t0 = getTickCount();
-    Ptr<MyFace> model = makePtr<MyFace>(ext,fil,cls,pre,crp,trainMethod,skip,lab);
+    Ptr<MyFace> model = makePtr<MyFace>(ext,fil,cls,pre,crp,trainMethod,skip,lab,copt);
 
     // load dataset
     Ptr<FR_lfw> dataset = FR_lfw::create();
@@ -254,7 +322,7 @@ int main(int argc, const char *argv[])
     }
 
 
-    vector<double> p_acc, p_tpr, p_fpr;
+    vector<double> p_acc, p_tpr, p_fpr, p_auc;
     for (unsigned int j=0; j<numSplits; ++j)
     {
         PROFILEX("splits");
@@ -284,6 +352,8 @@ int main(int argc, const char *argv[])
         }
 
         unsigned int incorrect[2] = {0}, correct[2] = {0};
+        Mat A, B;          // verifiers: all pairs of the split get scored at once,
+        vector<int> truth; //   so the roc comes from the same run
         vector < Ptr<Object> > &curr = dataset->getTest(j);
         for (unsigned int i=0; i<curr.size(); i+=skip)
         {
@@ -292,6 +362,15 @@ int main(int argc, const char *argv[])
             //cerr << i << "\t";
             Mat img1 = imread(path+example->image1, IMREAD_GRAYSCALE);
             Mat img2 = imread(path+example->image2, IMREAD_GRAYSCALE);
+            if (model->scores())
+            {
+                Mat f1, f2;
+                model->pair(img1, img2, f1, f2);
+                A.push_back(f1.reshape(1,1));
+                B.push_back(f2.reshape(1,1));
+                truth.push_back(example->same);
+                continue;
+            }
             bool same = model->same(img1,img2)>0;
             if (same == example->same)
                 correct[example->same]++;
@@ -299,11 +378,29 @@ int main(int argc, const char *argv[])
                 incorrect[example->same]++;
             //cerr << same << " " << example->same << "                 \r";
         }
+        double auc = -1;
+        if (! truth.empty())
+        {
+            PROFILEX("scores");
+            Mat_<float> s;
+            model->scoreBatch(A, B, s);
+            double t = model->threshold();
+            for (size_t i=0; i<truth.size(); i++)
+            {
+                bool same = s(int(i)) > t;
+                if (same == (truth[i] != 0))
+                    correct[truth[i]]++;
+                else
+                    incorrect[truth[i]]++;
+            }
+            auc = rocAuc(s, truth);
+            p_auc.push_back(auc);
+        }
 
         double acc = double(correct[1]+correct[0])/((curr.size()/skip));
         double tpr = double(correct[1])/(correct[1]+incorrect[1]);
         double fpr = double(incorrect[0])/(correct[0]+incorrect[0]);
-        printf("%4u %2.3f/%-2.3f  %2.3f                        \n", j, tpr,fpr,acc );
+        printf("%4u %2.3f/%-2.3f  %2.3f  auc %2.3f                \n", j, tpr,fpr,acc,auc );
         p_acc.push_back(acc);
         p_tpr.push_back(tpr);
         p_fpr.push_back(fpr);
@@ -319,6 +416,9 @@ int main(int argc, const char *argv[])
     mu_acc /= p_acc.size();
     mu_tpr /= p_tpr.size();
     mu_fpr /= p_fpr.size();
+    double mu_auc = 0.0;
+    for (size_t i=0; i<p_auc.size(); ++i)
+        mu_auc += p_auc[i] / p_auc.size();
     double sigma = 0.0;
     for (vector<double>::iterator it=p_acc.begin(); it!=p_acc.end(); ++it)
     {
@@ -329,12 +429,15 @@ int main(int argc, const char *argv[])
 
     int64 t1 = getTickCount();
     cerr << format("%-8s",TextureFeature::EXS[ext])  << " ";
-    cerr << format("%-7s",TextureFeature::FILS[fil]) << " ";
+    cerr << format("%-7s",fil.c_str()) << " ";
     cerr << format("%-7s",TextureFeature::CLS[cls])  << " ";
     //cerr << format("%-8s",TextureFeature::PPS[pre])  << " ";
     cerr << format("%-5s",trainMethod.c_str()) << "\t";
     //cerr << format("%2d %d %-6s",crp ,flp, trainMethod.c_str()) << "\t";
-    cerr << format("%3.4f/%-3.4f %3.4f/%-3.4f %3.4f",  mu_acc, se, mu_tpr, mu_fpr, ((t1-t0)/getTickFrequency())) << endl;
+    cerr << format("%3.4f/%-3.4f %3.4f/%-3.4f %3.4f",  mu_acc, se, mu_tpr, mu_fpr, ((t1-t0)/getTickFrequency()));
+    if (! p_auc.empty())
+        cerr << format(" auc %3.4f", mu_auc);
+    cerr << endl;
 
     return 0;
 }
@@ -0,0 +1,361 @@
+#ifndef _WIN32
+ #define _FILE_OFFSET_BITS 64 // off_t for fseeko / mmap, on 32 bit builds, too
+#endif
+#include "gallery.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+#endif
+using namespace cv;
+
+
+namespace TextureFeatureImpl
+{
+
+Gallery::Gallery()
+    : n(0)
+    , ncols(0)
+    , ntype(-1)
+{}
+
+Gallery::Gallery(const Mat &m)
+    : n(0)
+    , ncols(m.cols)
+    , ntype(m.type())
+{
+    if (m.empty())
+        return;
+    Chunk c;
+    c.buf = m;
+    c.data = m;
+    c.used = m.rows;
+    chunk.push_back(c);
+    start.push_back(0);
+    n = m.rows;
+}
+
+void Gallery::release()
+{
+    chunk.clear();
+    start.clear();
+    n = ncols = 0;
+    ntype = -1;
+}
+
+void Gallery::grow()
+{
+    size_t rowbytes = ncols * CV_ELEM_SIZE(ntype);
+    int nrows = std::max(int(CHUNK_BYTES / std::max(rowbytes, size_t(1))), int(MIN_ROWS));
+    Chunk c;
+    c.buf.create(1, int(nrows * rowbytes + ALIGN), CV_8U);
+    c.data = Mat(nrows, ncols, ntype, alignPtr(c.buf.ptr(), ALIGN));
+    c.used = 0;
+    chunk.push_back(c);
+    start.push_back(n);
+}
+
+void Gallery::push_back(const Mat &m)
+{
+    if (m.empty())
+        return;
+    if (n == 0)
+    {
+        release();
+        ncols = m.cols;
+        ntype = m.type();
+    }
+    CV_Assert(m.cols == ncols && m.type() == ntype);
+    for (int r=0; r<m.rows; )
+    {
+        if (chunk.empty() || chunk.back().used == chunk.back().data.rows)
+            grow();
+        Chunk &c = chunk.back();
+        int k = std::min(m.rows - r, c.data.rows - c.used);
+        Mat dst = c.data.rowRange(c.used, c.used + k);
+        m.rowRange(r, r + k).copyTo(dst);
+        c.used += k;
+        n += k;
+        r += k;
+    }
+}
+
+int Gallery::find(int r) const
+{
+    CV_Assert(r >= 0 && r < n);
+    return int(std::upper_bound(start.begin(), start.end(), r) - start.begin()) - 1;
+}
+
+Mat Gallery::row(int r) const
+{
+    int c = find(r);
+    return chunk[c].data.row(r - start[c]);
+}
+
+Mat Gallery::rowRange(int from, int to) const
+{
+    if (to <= from)
+        return Mat();
+    int c = find(from);
+    if (to <= start[c] + chunk[c].used)
+        return chunk[c].data.rowRange(from - start[c], to - start[c]);
+
+    Mat m(to - from, ncols, ntype);
+    for (int r=from; r<to; )
+    {
+        c = find(r);
+        int k = std::min(to, start[c] + chunk[c].used) - r;
+        chunk[c].data.rowRange(r - start[c], r - start[c] + k).copyTo(m.rowRange(r - from, r - from + k));
+        r += k;
+    }
+    return m;
+}
+
+
+static const char MAGIC[8] = {'T','F','G','A','L','L','R','Y'};
+static const int BLOCK = 1<<20;
+
+// 64 bit file offsets, long is 32 bit on windows (and 32 bit builds)
+static int seek64(FILE *f, int64 off, int whence)
+{
+#ifdef _WIN32
+    return _fseeki64(f, off, whence);
+#else
+    return fseeko(f, off_t(off), whence);
+#endif
+}
+
+static int64 tell64(FILE *f)
+{
+#ifdef _WIN32
+    return _ftelli64(f);
+#else
+    return int64(ftello(f));
+#endif
+}
+
+GalleryFile::GalleryFile()
+    : base(0)
+    , len(0)
+{}
+
+GalleryFile::~GalleryFile()
+{
+    unmap();
+}
+
+void GalleryFile::close()
+{
+    unmap();
+    fn = "";
+}
+
+bool GalleryFile::map()
+{
+    unmap();
+#ifndef _WIN32
+    int fd = ::open(fn.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < off_t(HEADER) || uint64(st.st_size) > uint64(size_t(-1)))
+    {
+        ::close(fd);
+        return false;
+    }
+    len = size_t(st.st_size);
+    void *p = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED)
+    {
+        len = 0;
+        return false;
+    }
+    base = (uchar*)p;
+#else
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (! f)
+        return false;
+    seek64(f, 0, SEEK_END);
+    int64 size = tell64(f);
+    seek64(f, 0, SEEK_SET);
+    if (size < int64(HEADER) || uint64(size) > uint64(size_t(-1)))
+    {
+        fclose(f);
+        return false;
+    }
+    len = size_t(size);
+    buffer.create(int((len + BLOCK - 1) / BLOCK), BLOCK, CV_8U); // continuous, a single row could not hold 2gb
+    bool ok = (fread(buffer.ptr(), 1, len, f) == len);
+    fclose(f);
+    if (! ok)
+    {
+        buffer.release();
+        len = 0;
+        return false;
+    }
+    base = buffer.ptr();
+#endif
+
+    const Header &h = header();
+    bool ok = (memcmp(h.magic, MAGIC, 8) == 0)
+           && (h.version == VERSION)
+           && (h.dims > 0) && (h.stride % ALIGN == 0)
+           && (size_t(h.dims) * CV_ELEM_SIZE(h.type) + sizeof(int) <= size_t(h.stride))
+           && (h.rows >= 0) && (uint64(HEADER) + uint64(h.rows) * h.stride <= uint64(len));
+    if (! ok)
+        unmap();
+    return ok;
+}
+
+void GalleryFile::unmap()
+{
+#ifndef _WIN32
+    if (base)
+        munmap(base, len);
+#endif
+    buffer.release();
+    base = 0;
+    len = 0;
+}
+
+bool GalleryFile::write(FILE *f, const Mat &features, const Mat &labels, int type, int stride) const
+{
+    Mat feat;
+    features.convertTo(feat, type);
+    size_t fbytes = feat.cols * feat.elemSize();
+    std::vector<uchar> rec(stride, 0);
+    for (int r=0; r<feat.rows; r++)
+    {
+        int l = labels.at<int>(r);
+        memcpy(&rec[0], feat.ptr(r), fbytes);
+        memcpy(&rec[fbytes], &l, sizeof(int));
+        if (fwrite(&rec[0], 1, stride, f) != size_t(stride))
+            return false;
+    }
+    return true;
+}
+
+bool GalleryFile::create(const String &filename, const Mat &features, const Mat &labels)
+{
+    close();
+    CV_Assert(features.channels() == 1 && int(labels.total()) == features.rows);
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, 8);
+    h.version = VERSION;
+    h.type = features.type();
+    h.dims = features.cols;
+    h.stride = int(alignSize(features.cols * features.elemSize() + sizeof(int), ALIGN));
+    h.rows = features.rows;
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (! f)
+        return false;
+    bool ok = (fwrite(&h, 1, HEADER, f) == size_t(HEADER))
+           && write(f, features, labels, h.type, h.stride);
+    ok = (fclose(f) == 0) && ok;
+    if (! ok)
+        return false;
+
+    fn = filename;
+    return map();
+}
+
+bool GalleryFile::open(const String &filename)
+{
+    close();
+    fn = filename;
+    if (map())
+        return true;
+    fn = "";
+    return false;
+}
+
+//
+// the records go first, the row count last,
+//   so a reader (or a crash) never sees a half written row.
+//
+bool GalleryFile::append(const Mat &features, const Mat &labels)
+{
+    CV_Assert(! empty());
+    CV_Assert(features.cols == header().dims && int(labels.total()) == features.rows);
+    Header h = header();
+
+    FILE *f = fopen(fn.c_str(), "r+b");
+    if (! f)
+        return false;
+    bool ok = (seek64(f, int64(HEADER) + h.rows * h.stride, SEEK_SET) == 0)
+           && write(f, features, labels, h.type, h.stride)
+           && (fflush(f) == 0);
+    if (ok)
+    {
+        h.rows += features.rows;
+        ok = (seek64(f, 0, SEEK_SET) == 0)
+          && (fwrite(&h, 1, HEADER, f) == size_t(HEADER));
+    }
+    ok = (fclose(f) == 0) && ok;
+    return map() && ok;
+}
+
+bool GalleryFile::setLabel(int row, int label)
+{
+    CV_Assert(row >= 0 && row < rows());
+    const Header &h = header();
+    int64 off = int64(HEADER) + int64(row) * h.stride + h.dims * CV_ELEM_SIZE(h.type);
+#ifdef _WIN32
+    memcpy(base + off, &label, sizeof(int)); // our own copy
+#endif
+    FILE *f = fopen(fn.c_str(), "r+b");
+    if (! f)
+        return false;
+    bool ok = (seek64(f, off, SEEK_SET) == 0)
+           && (fwrite(&label, 1, sizeof(int), f) == sizeof(int));
+    return (fclose(f) == 0) && ok;
+}
+
+//
+// other processes keep their mapping of the old file, until they reopen.
+//
+bool GalleryFile::rewrite(const Mat &features, const Mat &labels)
+{
+    CV_Assert(! empty());
+    String target = fn, tmp = fn + ".tmp";
+    Mat feat = features.empty() ? Mat(0, header().dims, header().type) : features;
+    {
+        GalleryFile g;
+        if (! g.create(tmp, feat, labels))
+            return false;
+    }
+    unmap();
+#ifdef _WIN32
+    std::remove(target.c_str()); // rename does not replace there
+#endif
+    bool ok = (std::rename(tmp.c_str(), target.c_str()) == 0);
+    return map() && ok;
+}
+
+Mat GalleryFile::features() const
+{
+    if (rows() == 0)
+        return Mat();
+    const Header &h = header();
+    return Mat(int(h.rows), h.dims, h.type, base + HEADER, h.stride);
+}
+
+Mat GalleryFile::labels() const
+{
+    if (rows() == 0)
+        return Mat();
+    const Header &h = header();
+    size_t off = h.dims * CV_ELEM_SIZE(h.type);
+    return Mat(int(h.rows), 1, CV_32S, base + HEADER + off, h.stride);
+}
+
+} // TextureFeatureImpl
@@ -0,0 +1,134 @@
+#ifndef __Gallery_onboard__
+#define __Gallery_onboard__
+
+#include <cstdio>
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+namespace TextureFeatureImpl
+{
+
+//
+// growable row storage made of fixed-size chunks, so appending never moves the rows already there.
+//   a Mat passed to the constructor gets wrapped as the first chunk (no copy),
+//   push_back() fills the last chunk, then allocates new ones (64 byte aligned, ~4mb each).
+//
+// the distance kernels walk it chunk by chunk, rowRange() and contiguous() only copy,
+//   if the range spans more than one chunk.
+//
+struct Gallery
+{
+    enum { CHUNK_BYTES=1<<22, MIN_ROWS=64, ALIGN=64 };
+
+    Gallery();
+    Gallery(const cv::Mat &m);
+
+    int rows() const { return n; }
+    int cols() const { return ncols; }
+    int type() const { return ntype; }
+    bool empty() const { return n == 0; }
+    void release();
+    void push_back(const cv::Mat &m);
+
+    int chunks() const { return int(chunk.size()); }
+    int offset(int c) const { return start[c]; }
+    cv::Mat getChunk(int c) const { return chunk[c].data.rowRange(0, chunk[c].used); }
+    int find(int r) const; // the chunk of row r
+
+    cv::Mat row(int r) const;
+    template <class T> const T *ptr(int r) const
+    {
+        int c = find(r);
+        return chunk[c].data.ptr<T>(r - start[c]);
+    }
+    template <class T> const T &at(int r) const { return *ptr<T>(r); }
+    template <class T> T *ptr(int r)
+    {
+        int c = find(r);
+        return chunk[c].data.ptr<T>(r - start[c]);
+    }
+
+    cv::Mat rowRange(int from, int to) const;
+    cv::Mat contiguous() const { return rowRange(0, n); }
+
+private:
+    struct Chunk
+    {
+        cv::Mat buf;  // owns the memory
+        cv::Mat data; // the whole capacity
+        int used;
+    };
+    std::vector<Chunk> chunk;
+    std::vector<int> start;
+    int n, ncols, ntype;
+
+    void grow();
+};
+
+
+//
+// a versioned binary gallery file, mapped read-only into memory.
+//
+//   [header, 64 bytes][record 0][record 1]...
+//   record: the feature row, then the int label, padded to a multiple of 32 bytes.
+//
+// features() and labels() are zero-copy headers into the mapping (step == stride),
+//   so opening is constant-time, and processes on one host share the pages.
+//   the file only ever grows at the end, so update() never rewrites it.
+//
+struct GalleryFile
+{
+    enum { VERSION=1, ALIGN=32, HEADER=64 };
+
+    struct Header
+    {
+        char magic[8];     // "TFGALLRY"
+        int version;
+        int type;          // opencv type of the feature rows
+        int dims;          // feature length
+        int stride;        // bytes per record
+        cv::int64 rows;
+        char reserved[HEADER - 8 - 4*sizeof(int) - sizeof(cv::int64)];
+    };
+
+    GalleryFile();
+    ~GalleryFile();
+
+    // map an existing file
+    bool open(const cv::String &fn);
+    // write a new file (features + labels), then map it
+    bool create(const cv::String &fn, const cv::Mat &features, const cv::Mat &labels);
+    // append rows at the end, then remap. old headers from features() / labels() get invalid !
+    bool append(const cv::Mat &features, const cv::Mat &labels);
+    // overwrite a single label in place (the mapping sees it)
+    bool setLabel(int row, int label);
+    // replace the whole content (write a new file, then rename it over the old one), and remap
+    bool rewrite(const cv::Mat &features, const cv::Mat &labels);
+    void close();
+
+    bool empty() const { return base == 0; }
+    int rows() const { return empty() ? 0 : int(header().rows); }
+    const cv::String &path() const { return fn; }
+
+    cv::Mat features() const;
+    cv::Mat labels() const;
+
+private:
+    cv::String fn;
+    uchar *base;
+    size_t len;
+    cv::Mat buffer; // no mmap on windows, the file gets read instead
+
+    const Header &header() const { return *(const Header*)base; }
+    bool map();
+    void unmap();
+    bool write(FILE *f, const cv::Mat &features, const cv::Mat &labels, int type, int stride) const;
+
+    GalleryFile(const GalleryFile &);            // owns the mapping
+    GalleryFile &operator=(const GalleryFile &);
+};
+
+} // TextureFeatureImpl
+
+#endif // __Gallery_onboard__
@@ -0,0 +1,301 @@
+#include "hnsw.h"
+
+#include <algorithm>
+#include <queue>
+#include <unordered_set>
+using namespace std;
+using namespace cv;
+
+
+namespace TextureFeatureImpl
+{
+
+Hnsw::Hnsw(int M, int efConstruction, int ef)
+    : M(M)
+    , efConstruction(efConstruction)
+    , ef(ef)
+    , entry(-1)
+    , maxLevel(-1)
+    , locks(NLOCKS)
+{}
+
+void Hnsw::clear()
+{
+    entry = -1;
+    maxLevel = -1;
+    levels.clear();
+    links.clear();
+}
+
+void Hnsw::neighbours(int id, int layer, bool locked, vector<int> &nb) const
+{
+    if (locked)
+    {
+        AutoLock lock(locks[id % NLOCKS]);
+        nb = links[id][layer];
+        return;
+    }
+    nb = links[id][layer];
+}
+
+//
+// greedy walk through the layers [from..to), beam width 1
+//
+void Hnsw::descend(const HnswSpace &space, const Mat &query, int &ep, float &d, int from, int to, bool locked) const
+{
+    vector<int> nb;
+    for (int l=from; l>to; l--)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            neighbours(ep, l, locked, nb);
+            for (size_t i=0; i<nb.size(); i++)
+            {
+                float de = space.dist(query, nb[i]);
+                if (de < d)
+                {
+                    d = de;
+                    ep = nb[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+//
+// with filter, removed items still get walked through, but they do not go into the result.
+//
+void Hnsw::searchLayer(const HnswSpace &space, const Mat &query, int ep, int ef, int layer, bool locked, bool filter, vector<Hit> &res) const
+{
+    unordered_set<int> visited;
+    priority_queue< Hit, vector<Hit>, greater<Hit> > cand; // closest first
+    priority_queue< Hit > top;                             // farthest first
+
+    float d = space.dist(query, ep);
+    visited.insert(ep);
+    cand.push(Hit(d, ep));
+    if (!filter || space.alive(ep))
+        top.push(Hit(d, ep));
+
+    vector<int> nb;
+    while (! cand.empty())
+    {
+        Hit c = cand.top();
+        bool full = !filter || int(top.size()) >= ef;
+        if (full && !top.empty() && c.first > top.top().first)
+            break;
+        cand.pop();
+
+        neighbours(c.second, layer, locked, nb);
+        for (size_t i=0; i<nb.size(); i++)
+        {
+            int e = nb[i];
+            if (! visited.insert(e).second)
+                continue;
+            float de = space.dist(query, e);
+            if (int(top.size()) < ef || de < top.top().first)
+            {
+                cand.push(Hit(de, e));
+                if (!filter || space.alive(e))
+                    top.push(Hit(de, e));
+                if (int(top.size()) > ef)
+                    top.pop();
+            }
+        }
+    }
+    res.resize(top.size());
+    for (int i=int(res.size())-1; i>=0; i--)
+    {
+        res[i] = top.top();
+        top.pop();
+    }
+}
+
+//
+// keep a candidate only if it is closer to the base than to any of the selected,
+//   this keeps the graph connected across clusters. (cand is sorted ascending)
+//
+void Hnsw::selectNeighbours(const HnswSpace &space, const vector<Hit> &cand, int m, vector<int> &sel) const
+{
+    sel.clear();
+    for (size_t i=0; i<cand.size() && int(sel.size())<m; i++)
+    {
+        if (sel.empty())
+        {
+            sel.push_back(cand[i].second); // the closest one is always kept
+            continue;
+        }
+        Mat c = space.prepareQuery(space.item(cand[i].second));
+        bool good = true;
+        for (size_t j=0; j<sel.size() && good; j++)
+            good = space.dist(c, sel[j]) >= cand[i].first;
+        if (good)
+            sel.push_back(cand[i].second);
+    }
+}
+
+void Hnsw::insert(const HnswSpace &space, int id)
+{
+    int level = levels[id];
+
+    global.lock();
+    int ep = entry, top = maxLevel;
+    if (ep < 0)
+    {
+        entry = id;
+        maxLevel = level;
+        global.unlock();
+        return;
+    }
+    bool raise = level > top; // keep the lock, the entry point will change
+    if (! raise)
+        global.unlock();
+
+    Mat q = space.prepareQuery(space.item(id));
+    float d = space.dist(q, ep);
+    descend(space, q, ep, d, top, level, true);
+
+    vector<Hit> W;
+    vector<int> sel;
+    for (int l=std::min(level, top); l>=0; l--)
+    {
+        searchLayer(space, q, ep, efConstruction, l, true, false, W);
+        selectNeighbours(space, W, M, sel);
+        {
+            AutoLock lock(locks[id % NLOCKS]);
+            links[id][l] = sel;
+        }
+        for (size_t i=0; i<sel.size(); i++)
+        {
+            int e = sel[i];
+            AutoLock lock(locks[e % NLOCKS]);
+            vector<int> &le = links[e][l];
+            le.push_back(id);
+            if (int(le.size()) > maxLinks(l)) // shrink, same heuristic
+            {
+                Mat ie = space.prepareQuery(space.item(e));
+                vector<Hit> c;
+                for (size_t j=0; j<le.size(); j++)
+                    c.push_back(Hit(space.dist(ie, le[j]), le[j]));
+                std::sort(c.begin(), c.end());
+                selectNeighbours(space, c, maxLinks(l), le);
+            }
+        }
+        ep = W[0].second;
+    }
+
+    if (raise)
+    {
+        entry = id;
+        maxLevel = level;
+        global.unlock();
+    }
+}
+
+struct Hnsw::Inserter : public ParallelLoopBody
+{
+    Hnsw &graph;
+    const HnswSpace &space;
+
+    Inserter(Hnsw &graph, const HnswSpace &space) : graph(graph), space(space) {}
+
+    virtual void operator()(const Range &range) const
+    {
+        for (int i=range.start; i<range.end; i++)
+            graph.insert(space, i);
+    }
+};
+
+void Hnsw::add(const HnswSpace &space, int from, int to)
+{
+    CV_Assert(from == size()); // append only
+    if (to <= from)
+        return;
+
+    // draw the levels up front, so the parallel inserts never reallocate
+    RNG rng(0x1f2e3d4c + from);
+    double mult = 1.0 / std::log(double(std::max(M, 2)));
+    levels.resize(to);
+    links.resize(to);
+    for (int i=from; i<to; i++)
+    {
+        double u = std::max(rng.uniform(0.0, 1.0), 1e-12);
+        levels[i] = int(-std::log(u) * mult);
+        links[i].assign(levels[i]+1, vector<int>());
+    }
+
+    int start = from;
+    if (entry < 0)
+        insert(space, start++);
+    parallel_for_(Range(start, to), Inserter(*this, space));
+}
+
+void Hnsw::search(const HnswSpace &space, const Mat &query, int k, vector<Hit> &res) const
+{
+    res.clear();
+    if (entry < 0)
+        return;
+
+    int ep = entry;
+    Mat q = space.prepareQuery(query);
+    float d = space.dist(q, ep);
+    descend(space, q, ep, d, maxLevel, 0, false);
+    searchLayer(space, q, ep, std::max(ef, k), 0, false, true, res);
+    if (int(res.size()) > k)
+        res.resize(k);
+}
+
+bool Hnsw::save(TextureFeature::Archive &ar) const
+{
+    vector<int> flat; // per node and layer: count, ids
+    for (size_t i=0; i<links.size(); i++)
+    {
+        for (size_t l=0; l<links[i].size(); l++)
+        {
+            flat.push_back(int(links[i][l].size()));
+            flat.insert(flat.end(), links[i][l].begin(), links[i][l].end());
+        }
+    }
+    ar << "hnsw_M" << M;
+    ar << "hnsw_efc" << efConstruction;
+    ar << "hnsw_ef" << ef;
+    ar << "hnsw_entry" << entry;
+    ar << "hnsw_maxlevel" << maxLevel;
+    ar << "hnsw_levels" << Mat(levels);
+    ar << "hnsw_links" << Mat(flat);
+    return true;
+}
+
+bool Hnsw::load(const TextureFeature::Archive &ar)
+{
+    if (ar["hnsw_levels"].empty())
+        return false;
+
+    clear();
+    Mat lv, fl;
+    ar["hnsw_M"] >> M;
+    ar["hnsw_efc"] >> efConstruction;
+    // ef only matters while searching, the one this was set up with wins over the saved one
+    ar["hnsw_entry"] >> entry;
+    ar["hnsw_maxlevel"] >> maxLevel;
+    ar["hnsw_levels"] >> lv;
+    ar["hnsw_links"] >> fl;
+    const int *p = fl.ptr<int>();
+    for (size_t i=0; i<lv.total(); i++)
+    {
+        levels.push_back(lv.at<int>(int(i)));
+        links.push_back(vector< vector<int> >(levels.back()+1));
+        for (size_t l=0; l<links.back().size(); l++)
+        {
+            int n = *p++;
+            links.back()[l].assign(p, p+n);
+            p += n;
+        }
+    }
+    return true;
+}
+
+} // TextureFeatureImpl
@@ -0,0 +1,79 @@
+#ifndef __Hnsw_onboard__
+#define __Hnsw_onboard__
+
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include "archive.h"
+
+
+namespace TextureFeatureImpl
+{
+
+//
+// the space a graph index lives in, usually the gallery of a classifier.
+//
+struct HnswSpace
+{
+    // the per query part of the distance (transforms, inverses), done once per search,
+    //   not per graph hop. dist() gets the result of this as its query.
+    virtual cv::Mat prepareQuery(const cv::Mat &query) const { return query; }
+    virtual float dist(const cv::Mat &query, int id) const = 0;
+    virtual cv::Mat item(int id) const = 0;
+    // removed items stay in the graph (to keep it connected), but never show up in a search
+    virtual bool alive(int id) const { return true; }
+};
+
+
+//
+// Malkov, Yashunin: "Efficient and robust approximate nearest neighbor search
+//   using Hierarchical Navigable Small World graphs"
+//
+// the graph only keeps ids, the features stay in the space.
+//
+struct Hnsw
+{
+    typedef std::pair<float,int> Hit; // (dist,id)
+
+    int M;              // links per node and layer (2*M on the bottom layer)
+    int efConstruction; // beam width while building
+    int ef;             // beam width while searching, recall <-> speed
+
+    Hnsw(int M=16, int efConstruction=200, int ef=64);
+
+    int size() const { return int(levels.size()); }
+    void clear();
+
+    // insert the items [from..to) of the space, multi-threaded
+    void add(const HnswSpace &space, int from, int to);
+
+    // k nearest, sorted ascending
+    void search(const HnswSpace &space, const cv::Mat &query, int k, std::vector<Hit> &res) const;
+
+    bool save(TextureFeature::Archive &ar) const;
+    bool load(const TextureFeature::Archive &ar);
+
+private:
+    enum { NLOCKS = 1024 };
+
+    int entry;
+    int maxLevel;
+    std::vector<int> levels;
+    std::vector< std::vector< std::vector<int> > > links; // node -> layer -> neighbours
+    mutable std::vector<cv::Mutex> locks; // striped, only used while building
+    cv::Mutex global;
+
+    struct Inserter;
+
+    int maxLinks(int layer) const { return layer==0 ? 2*M : M; }
+    void insert(const HnswSpace &space, int id);
+    void neighbours(int id, int layer, bool locked, std::vector<int> &nb) const;
+    void descend(const HnswSpace &space, const cv::Mat &query, int &ep, float &d, int from, int to, bool locked) const;
+    void searchLayer(const HnswSpace &space, const cv::Mat &query, int ep, int ef, int layer, bool locked, bool filter, std::vector<Hit> &res) const;
+    void selectNeighbours(const HnswSpace &space, const std::vector<Hit> &cand, int m, std::vector<int> &sel) const;
+};
+
+} // TextureFeatureImpl
+
+#endif // __Hnsw_onboard__
@@ -58,13 +58,15 @@ class FaceRec
     Ptr<TextureFeature::Classifier> classifier;
 
     map<int,String> persons;
+    String tag; // the pipeline, a saved model only fits the one it was trained with
 
 public:
-    FaceRec(int ext, int red, int cls)
+    FaceRec(int ext, int red, int cls, const String &opts="")
         : pre(3, 0, FIXED_FACE)
         , extractor(TextureFeature::createExtractor(ext))
         , filter(TextureFeature::createFilter(red))
-        , classifier(TextureFeature::createClassifier(cls))
+        , classifier(TextureFeature::createClassifier(cls, opts))
+        , tag(format("%s %s %s", TextureFeature::EXS[ext], TextureFeature::FILS[red], TextureFeature::CLS[cls]))
     {}
 
     int train(const String &imgdir)
@@ -100,12 +102,19 @@ public:
 
             Mat feature;
             extractor->extract(pre.process(img), feature);
-            if (!filter.empty())
-                filter->filter(feature.reshape(1,1), feature);
-            features.push_back(feature);
+            features.push_back(feature.reshape(1,1));
             labels.push_back(label);
         }
-        return classifier->train(features, labels);
+        if (!filter.empty())
+        {
+            filter->train(features, labels);
+            filter->filterBatch(features, features);
+        }
+        int ok = classifier->train(features, labels);
+        String info = classifier->info();
+        if (! info.empty())
+            cerr << info << endl;
+        return ok;
     }
 
     String predict(const Mat & img)
@@ -133,39 +142,50 @@ public:
         return format("%s : %2.3f", persons[id].c_str(), conf);
     }
 
+    // binary, or a FileStorage text export for .yml / .xml / .json names
     bool load(const String &fn)
     {
-        FileStorage fs(fn, FileStorage::READ);
-        if (! fs.isOpened())
+        TextureFeature::Archive ar;
+        if (! ar.load(fn))
             return false;
-        bool ok = classifier->load(fs);
-        FileNode pers = fs["persons"];
-        FileNodeIterator it = pers.begin();
-        for( ; it != pers.end(); ++it )
+        if (ar.tag != tag)
         {
-            int id;
-            (*it) >> id;
-            string s =(*it).name();
-            persons[id] = s;
+            cerr << fn << " : was saved from " << ar.tag << ", not from " << tag << endl;
+            return false;
         }
-        fs.release();
+        bool ok = classifier->load(ar);
+        if (!filter.empty())
+            filter->load(ar); // fixed filters have nothing to load
+
+        // the names go in as one string, one per line
+        Mat ids;
+        String names;
+        ar["persons_ids"] >> ids;
+        ar["persons_names"] >> names;
+        persons.clear();
+        stringstream ss(names);
+        string s;
+        for (int i=0; i<int(ids.total()) && getline(ss, s); i++)
+            persons[ids.at<int>(i)] = s;
         return ok;
     }
     bool save(const String &fn)
     {
-        FileStorage fs(fn, FileStorage::WRITE);
-        if (! fs.isOpened())
-            return false;
-        bool ok = classifier->save(fs);
-        fs << "persons" << "{";
+        TextureFeature::Archive ar(tag);
+        bool ok = classifier->save(ar);
+        if (!filter.empty())
+            filter->save(ar);
+        Mat ids;
+        String names;
         map<int,String>::iterator it = persons.begin();
         for ( ; it != persons.end(); ++it )
         {
-            fs << it->second << it->first;
+            ids.push_back(it->first);
+            names += it->second + "\n";
         }
-        fs << "}";
-        fs.release();
-        return ok;
+        ar << "persons_ids" << ids;
+        ar << "persons_names" << names;
+        return ar.save(fn) && ok;
     }
 };
 
@@ -189,10 +209,13 @@ int main(int argc, const char *argv[])
     std::string cascade_path("data/haarcascade_frontalface_alt2.xml");
     if (argc > 3) cascade_path=argv[3];
 
+    string opts(""); // classifier options, like budget=200
+    if (argc > 4) opts=argv[4];
+
     if (argc == 1)
     {
-        cerr << "please use : online [capture id or path] [img_path] [cascade_path]" << endl;
-        cerr << "[current]  : online " << cp << " " << imgpath <<  " " << cascade_path << endl << endl;
+        cerr << "please use : online [capture id or path] [img_path] [cascade_path] [classifier options]" << endl;
+        cerr << "[current]  : online " << cp << " " << imgpath <<  " " << cascade_path << " " << opts << endl << endl;
     }
 
     namedWindow("reco");
@@ -210,11 +233,12 @@ int main(int argc, const char *argv[])
     // feel free to swap parts here, it's intended for that..
     FaceRec reco(TextureFeature::EXT_PNET,
                  TextureFeature::FIL_NONE,
-                 TextureFeature::CL_MLP);
+                 TextureFeature::CL_MLP,
+                 opts);
     int n = reco.train(imgpath);
     cerr << n << endl;
 
-    String save_model = "face.yml.gz";
+    String save_model = "face.model"; // "face.yml.gz" for a text export
     // alternatively, load a serialized model.
     //reco.load(save_model);
 
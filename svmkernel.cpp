@@ -2,8 +2,13 @@
 //#define HAVE_SSE
 
 #include <opencv2/ml.hpp>
+#include <opencv2/core/utility.hpp>
 using namespace cv;
 
+#if defined(HAVE_SSE) || defined(HAVE_AVX2)
+ #include <immintrin.h>
+#endif
+
 #include "texturefeature.h"
 
 using namespace TextureFeature;
@@ -11,250 +16,257 @@ using namespace TextureFeature;
 namespace TextureFeatureImpl
 {
 
-struct CustomKernel : public ml::SVM::Kernel
+//
+// the inner loops, avx2/fma (8 lanes) and sse (4 lanes) with a scalar tail,
+//   so any var_count works, and unaligned rows are fine.
+//
+#if defined(HAVE_AVX2)
+static inline float hsum(__m256 v)
 {
-    int K;
-    CustomKernel(int k) : K(k) {}
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    float f[4]; _mm_storeu_ps(f, s);
+    return f[0] + f[1] + f[2] + f[3];
+}
+#endif
+#if defined(HAVE_SSE)
+static inline float hsum(__m128 v)
+{
+    float f[4]; _mm_storeu_ps(f, v);
+    return f[0] + f[1] + f[2] + f[3];
+}
+#endif
 
-#ifdef HAVE_SSE
-    inline float res(const __m128 & s)
+static float l2sqr(const float *a, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
     {
-        union { __m128 m; float f[4]; } x;
-        x.m = s;
-        return (x.f[0] + x.f[1] + x.f[2] + x.f[3]);
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k));
+        s8 = _mm256_fmadd_ps(d, d, s8);
     }
+    s += hsum(s8);
 #endif
-
-
-    float l2sqr(int var_count, int j, const float *vecs, const float *another)
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
     {
-#ifdef HAVE_SSE
-        if (var_count % 4 == 0)
-        {
-            __m128 c,d, s = _mm_set_ps1(0);
-            __m128* ptr_a = (__m128*)another;
-            __m128* ptr_b = (__m128*)(&vecs[j*var_count]);
-            for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-            {
-                c = _mm_sub_ps(*ptr_a, *ptr_b);
-                d = _mm_mul_ps(c, c);
-                s = _mm_add_ps(s, d);
-            }
-            return res(s);
-        } // else fall back to sw
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k));
+        s4 = _mm_add_ps(s4, _mm_mul_ps(d, d));
+    }
+    s += hsum(s4);
 #endif
-        float s = 0;
-        float a,b,c;
-        const float* sample = &vecs[j*var_count];
-        for(int k=0; k<var_count; k++)
-        {
-            a = sample[k];  b = another[k];
-            c = (a-b);
-            s += c*c;
-        }
-        return s;
+    for (; k<n; k++)
+    {
+        float d = a[k] - b[k];
+        s += d * d;
     }
+    return s;
+}
 
-    float min(int var_count, int j, const float *vecs, const float *another)
-    {
-#ifdef HAVE_SSE
-        if (var_count % 4 == 0)
-        { 
-            __m128 c,   s = _mm_set_ps1(0);
-            __m128* ptr_a = (__m128*)another;
-            __m128* ptr_b = (__m128*)(&vecs[j*var_count]);
-            for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-            {
-                c = _mm_min_ps(*ptr_a, *ptr_b);
-                s = _mm_add_ps(s, c);
-            }
-            return res(s);
-        }
+static float minsum(const float *a, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
+        s8 = _mm256_add_ps(s8, _mm256_min_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k)));
+    s += hsum(s8);
 #endif
-        float s = 0;
-        float a,b,c;
-        const float* sample = &vecs[j*var_count];
-        for(int k=0; k<var_count; k++)
-        {
-            a = sample[k];  b = another[k];
-            c = std::min(a,b);
-            s += c*c;
-        }
-        return s;
-    }
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
+        s4 = _mm_add_ps(s4, _mm_min_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k)));
+    s += hsum(s4);
+#endif
+    for (; k<n; k++)
+        s += std::min(a[k], b[k]);
+    return s;
+}
+
+static float dot(const float *a, const float *b, int n)
+{
+    int k = 0;
+    float s = 0;
+#if defined(HAVE_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for (; k<=n-8; k+=8)
+        s8 = _mm256_fmadd_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k), s8);
+    s += hsum(s8);
+#endif
+#if defined(HAVE_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for (; k<=n-4; k+=4)
+        s4 = _mm_add_ps(s4, _mm_mul_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k)));
+    s += hsum(s4);
+#endif
+    for (; k<n; k++)
+        s += a[k] * b[k];
+    return s;
+}
+
+
+struct CustomKernel : public ml::SVM::Kernel
+{
+    enum { PARALLEL_MIN = 1<<16 }; // vcount * var_count, below that, threads do not pay off
+
+    int K;
 
-    void calc_intersect(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    // the transformed vectors (sqrt for hellinger, pairwise sums for lowpass),
+    //   kept as long as the same vectors come in (all of train(), or all predictions).
+    Mutex mutex;
+    const float *cacheSrc;
+    Mat cacheEnds; // 1st and last row of the source, to catch reused memory
+    Mat cache;
+
+    CustomKernel(int k) : K(k), cacheSrc(0) {}
+
+    bool transformed() const
     {
-        for(int j=0; j<vcount; j++)
-        {
-            results[j] = min(var_count,j,vecs,another);
-        }
+        return (K == -1) || (K == -6);
     }
 
-    void calc_hellinger(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    Mat transform(const Mat &v) const
     {
-        CV_Assert (var_count<64000);
-        //float z[64000]; // there *must* be a better idea than this.
-        cv::AutoBuffer<float> buf(var_count);
-        float *z = buf;
-#ifdef HAVE_SSE
-        if (var_count%4 == 0)
-        {
-            __m128* ptr_out= (__m128*)z;
-            __m128* ptr_in = (__m128*)another;
-            // cache sqrt(another[k])        
-            for(int k=0; k<var_count; k+=4, ptr_in++, ptr_out++)
-            {
-                *ptr_out = _mm_sqrt_ps(*ptr_in);
-            }
-            for(int j=0; j<vcount; j++)
-            {
-                __m128 a,b,c,s = _mm_set_ps1(0);
-                __m128* ptr_a = (__m128*)(&vecs[j*var_count]);
-                __m128* ptr_b = (__m128*)z;
-                for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-                {
-                    a = _mm_sqrt_ps(*ptr_a);
-                    b = _mm_sub_ps(a, *ptr_b);
-                    c = _mm_mul_ps(b, b);
-                    s = _mm_add_ps(s, c);
-                }
-                results[j] = -res(s);
-            }
-            return;
-        }
-#endif       
-        for(int k=0; k<var_count; k+=4)
+        Mat t;
+        switch(K)
         {
-            z[k]   = sqrt(another[k]);
-            z[k+1] = sqrt(another[k+1]);
-            z[k+2] = sqrt(another[k+2]);
-            z[k+3] = sqrt(another[k+3]);
+        case -1:
+            cv::sqrt(v, t);
+            break;
+        case -6:
+            if (v.cols < 2)
+                return Mat::zeros(v.rows, 1, CV_32F);
+            cv::sqrt(v.colRange(0, v.cols-1) + v.colRange(1, v.cols), t);
+            break;
+        default:
+            t = v;
         }
+        return t;
+    }
 
-        for(int j=0; j<vcount; j++)
-        {
-            double a,b, s = 0;
-            const float* sample = &vecs[j*var_count];
-            for(int k=0; k<var_count; k+=4)
-            {
-                a = sqrt(sample[k]);     b = z[k];    s += (a - b) * (a - b);
-                a = sqrt(sample[k+1]);   b = z[k+1];  s += (a - b) * (a - b);
-                a = sqrt(sample[k+2]);   b = z[k+2];  s += (a - b) * (a - b);
-                a = sqrt(sample[k+3]);   b = z[k+3];  s += (a - b) * (a - b);
-            }
-            results[j] = (float)(-s);
-        }
+    Mat ends(const Mat &v) const
+    {
+        Mat e;
+        e.push_back(v.row(0));
+        e.push_back(v.row(v.rows-1));
+        return e;
     }
 
-    // assumes, you did the sqrt before on the input data !    
-    void calc_hellinger_sqrt(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    Mat cached(const Mat &v)
     {
-        for(int j=0; j<vcount; j++)
+        AutoLock lock(mutex);
+        bool same = (cacheSrc == v.ptr<float>()) && (cache.rows == v.rows)
+                 && (cacheEnds.cols == v.cols) && (norm(cacheEnds, ends(v), NORM_INF) == 0);
+        if (! same)
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = -(z);
+            cache = transform(v);
+            cacheEnds = ends(v);
+            cacheSrc = v.ptr<float>();
         }
+        return cache; // a reference, a rebuild does not touch it
     }
 
-    void calc_lowpass(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    // the kernel value for 2 (transformed) rows
+    inline float eval(const float *v, const float *q, int n) const
     {
-        for(int j=0; j<vcount; j++)
+        switch(K)
+        {
+        case -1: // hellinger
+        case -2: // hellinger, assumes, you did the sqrt before on the input data !
+            return -l2sqr(v, q, n);
+        case -5: // intersection
+            return minsum(v, q, n);
+        case -6: // lowpass: sum(sqrt((a[k]+a[k+1]) * (b[k]+b[k+1])))
+            return dot(v, q, n);
+        case -7: // log
+            return float(-log(l2sqr(v, q, n) + 1));
+        //
+        // KMOD-A New Support Vector Machine Kernel With Moderate Decreasing for
+        //  Pattern Recognition. Application to Digit Image Recognition.
+        //    N.E. Ayat  M. Cheriet  L. Remaki C.Y. Suen
+        //
+        //  (4) KMOD(x,y) = K *(exp(gamma / ((||x-y||^2) + (sigma^2))) - 1)
+        //
+        case -8:
         {
-            double s = 0;
-            double a1,a2,b1,b2;
-            const float* sample = &vecs[j*var_count];
-            for(int k=0; k<var_count-1; k++)
-            {
-                a1 = sample[k];    a2 = sample[k+1];
-                b1 = another[k];   b2 = another[k+1];
-                s += sqrt((a1+a2) * (b1+b2));
-            }
-            results[j] = (float)(s);
+            const float K  = 1.0f;  // normalization constant
+            const float s2 = 15.0f; // kernelsize squared
+            const float ga = 0.7f;  // decrease speed
+            return K * (exp(ga / (l2sqr(v, q, n) + s2)) - 1);
         }
-    }
-    void calc_log(int vcount, int var_count, const float* vecs, const float* another, float* results)
-    {
-        for(int j=0; j<vcount; j++)
+        // http://crsouza.blogspot.de/2010/03/kernel-functions-for-machine-learning.html
+        case -9: // cauchy
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = float(-log(z+1));
+            const float sigma2 = 3*3;
+            return 1.0f / (1.0f + (l2sqr(v, q, n) / sigma2));
         }
-    }
-    //
-    // KMOD-A New Support Vector Machine Kernel With Moderate Decreasing for
-    //  Pattern Recognition. Application to Digit Image Recognition.
-    //    N.E. Ayat  M. Cheriet  L. Remaki C.Y. Suen
-    // 
-    //  (4) KMOD(x,y) = K *(exp(gamma / ((||x-y||^2) + (sigma^2))) - 1)
-    //
-    void calc_kmod(int vcount, int var_count, const float* vecs, const float* another, float* results)
-    {
-        const float K  = 1.0f;  // normalization constant
-        const float s2 = 15.0f; // kernelsize squared
-        const float ga = 0.7f;  // decrease speed
-
-        for(int j=0; j<vcount; j++)
+        case -10: // rbf
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = K * (exp(ga/(z+s2))-1);
+            const float gamma = 0.8f; // same as ClassifierSVM's default
+            return exp(-gamma * l2sqr(v, q, n));
         }
-    }
-    // http://crsouza.blogspot.de/2010/03/kernel-functions-for-machine-learning.html
-    // special case for d=2, so it cancels the sqrt
-    void calc_rational_quadratic(int vcount, int var_count, const float* vecs, const float* another, float* results)
-    {
-        const static float C=10.0f;
-        for(int j=0; j<vcount; j++)
+        // special case for d=2, so it cancels the sqrt
+        case -11: // rational quadratic
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f - z / (z+C);
+            const float C = 10.0f;
+            float z = l2sqr(v, q, n);
+            return 1.0f - z / (z + C);
         }
-    }
-
-    void calc_inv_multiquad(int vcount, int var_count, const float* vecs, const float* another, float* results)
-    {
-        float C2 = 100;
-        for(int j=0; j<vcount; j++)
+        case -12: // inverse multiquadric
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f/sqrt(z+C2);
+            const float C2 = 100;
+            return 1.0f / sqrt(l2sqr(v, q, n) + C2);
         }
-    }
-    void calc_laplacian(int vcount, int var_count, const float* vecs, const float* another, float* results)
-    {
-        float sigma = 3;
-        for(int j=0; j<vcount; j++)
+        case -13: // laplacian
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = exp(-sqrt(z) / sigma);
+            const float sigma = 3;
+            return exp(-sqrt(l2sqr(v, q, n)) / sigma);
+        }
         }
+        return 0;
     }
-    void calc_cauchy(int vcount, int var_count, const float* vecs, const float* another, float* results)
+
+    struct Rows : public ParallelLoopBody
     {
-        float sigma2 = 3*3;
-        for(int j=0; j<vcount; j++)
+        const CustomKernel &kernel;
+        const Mat &vecs, &query;
+        float *results;
+
+        Rows(const CustomKernel &kernel, const Mat &vecs, const Mat &query, float *results)
+            : kernel(kernel), vecs(vecs), query(query), results(results)
+        {}
+
+        virtual void operator()(const Range &range) const
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f / (1.0f+(z/sigma2));
+            const float *q = query.ptr<float>();
+            for (int j=range.start; j<range.end; j++)
+                results[j] = kernel.eval(vecs.ptr<float>(j), q, vecs.cols);
         }
-    }
+    };
+
     void calc(int vcount, int var_count, const float* vecs, const float* another, float* results)
     {
-        switch(K)
+        if (vcount <= 0)
+            return;
+        Mat v(vcount, var_count, CV_32F, (void*)vecs);
+        Mat q(1, var_count, CV_32F, (void*)another);
+        if (transformed())
         {
-        case -1: calc_hellinger(vcount, var_count, vecs, another, results); break;
-        case -2: calc_hellinger_sqrt(vcount, var_count, vecs, another, results); break;
-        //case -2: calc_correl(vcount, var_count, vecs, another, results); break;
-        //case -3: calc_cosine(vcount, var_count, vecs, another, results); break;
-        //case -4: calc_bhattacharyya(vcount, var_count, vecs, another, results); break;
-        case -5: calc_intersect(vcount, var_count, vecs, another, results); break;
-        case -6: calc_lowpass(vcount, var_count, vecs, another, results); break;
-        case -7: calc_log(vcount, var_count, vecs, another, results); break;
-        case -8: calc_kmod(vcount, var_count, vecs, another, results); break;
-        case -9: calc_cauchy(vcount, var_count, vecs, another, results); break;
+            v = cached(v);
+            q = transform(q);
         }
+
+        Rows rows(*this, v, q, results);
+        if (double(vcount) * var_count < PARALLEL_MIN)
+            rows(Range(0, vcount));
+        else
+            parallel_for_(Range(0, vcount), rows);
     }
+
     int getType(void) const
     {
         return 7;
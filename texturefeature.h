@@ -6,6 +6,8 @@ using cv::Mat;
 using cv::String;
 using cv::FileStorage;
 
+#include "archive.h"
+
 
 //
 // interfaces
@@ -17,15 +19,35 @@ namespace TextureFeature
         virtual int extract(const Mat &img, Mat &features) const = 0;
     };
 
-    struct Filter
+    struct Serialize // io, see archive.h
     {
-        virtual int filter(const Mat &src, Mat &dest) const = 0;
+        virtual bool save(Archive &ar) const  { return false; }
+        virtual bool load(const Archive &ar)  { return false; }
     };
 
-    struct Serialize // io
+    struct Filter : public Serialize
     {
-        virtual bool save(FileStorage &fs) const  { return false; }
-        virtual bool load(const FileStorage &fs)  { return false; }
+        virtual int filter(const Mat &src, Mat &dest) const = 0;
+
+        // one feature per row
+        virtual int filterBatch(const Mat &src, Mat &dest) const
+        {
+            Mat res;
+            for (int i=0; i<src.rows; i++)
+            {
+                Mat f;
+                filter(src.row(i), f);
+                res.push_back(f.reshape(1,1));
+            }
+            dest = res;
+            return res.rows;
+        }
+
+        // most filters are fixed, the trainable ones learn from the gallery
+        virtual int train(const Mat &features, const Mat &labels)
+        {
+            return 0;
+        }
     };
 
     struct Classifier : public Serialize // identification
@@ -36,12 +58,91 @@ namespace TextureFeature
         {
             throw("not implemented!");
         }
+
+        // remove enrolled items, all items for a label, or a single row. returns the number removed.
+        virtual int removeLabel(int label)
+        {
+            throw("not implemented!");
+        }
+        virtual int removeIndex(int index)
+        {
+            throw("not implemented!");
+        }
+        // removed rows stay as tombstones, so the indices do not change under the caller.
+        //   compact() drops them for good, and renumbers the rows. returns the number dropped.
+        virtual int removed() const
+        {
+            return 0;
+        }
+        virtual int compact()
+        {
+            return 0;
+        }
+
+        // a line about the trained model (e.g. the reduced set error), empty if there's nothing to tell
+        virtual cv::String info() const
+        {
+            return "";
+        }
+
+        // keep the gallery in a memory mapped binary file (written, if already trained, else opened)
+        virtual bool attachGallery(const cv::String &fn)
+        {
+            return false;
+        }
+
+        //
+        // one query per row, k best matches per query:
+        //   results is queries.rows x 3*k float, (label,distance,index) triples, -1 if not available
+        //
+        virtual int predictBatch(const Mat &queries, int k, Mat &results) const
+        {
+            results = Mat(queries.rows, 3*k, CV_32F, cv::Scalar(-1));
+            for (int i=0; i<queries.rows; i++)
+            {
+                Mat res;
+                predict(queries.row(i), res);
+                for (size_t j=0; j<std::min(size_t(3), res.total()); j++)
+                    results.at<float>(i, int(j)) = res.at<float>(int(j));
+            }
+            return results.rows;
+        }
     };
 
     struct Verifier : public Serialize   // same-notSame
     {
         virtual bool same(const Mat &a, const Mat &b) const = 0;
         virtual int train(const Mat &features, const Mat &labels) = 0;
+
+        //
+        // a continuous score, higher means more alike, same() is score() > threshold(),
+        //   so a threshold can be picked after the fact, e.g. from a roc curve.
+        //
+        virtual double score(const Mat &a, const Mat &b) const
+        {
+            throw("not implemented!");
+        }
+        // one pair per row of A and B, scores is A.rows x 1 float
+        virtual int scoreBatch(const Mat &A, const Mat &B, Mat &scores) const
+        {
+            scores.create(A.rows, 1, CV_32F);
+            for (int i=0; i<A.rows; i++)
+                scores.at<float>(i) = float(score(A.row(i), B.row(i)));
+            return scores.rows;
+        }
+        virtual double threshold() const
+        {
+            return 0;
+        }
+        // a line about the trained model, empty if there's nothing to tell
+        virtual cv::String info() const
+        {
+            return "";
+        }
+        virtual void setThreshold(double t)
+        {
+            throw("not implemented!");
+        }
     };
 }
 
@@ -144,6 +245,17 @@ namespace TextureFeature
         FIL_DCT12,
         FIL_DCT16,
         FIL_DCT24,
+        FIL_KMAP_CHI2,
+        FIL_KMAP_INT,
+        FIL_KMAP_HELL,
+        FIL_NYS_RBF,
+        FIL_NYS_LOG,
+        FIL_NYS_KMOD,
+        FIL_NYS_CAUCHY,
+        FIL_FISHER4,
+        FIL_FISHER8,
+        FIL_CHISEL4,
+        FIL_CHISEL8,
         FIL_MAX
     };
     static const char *FILS[] = {
@@ -163,6 +275,17 @@ namespace TextureFeature
         "DCT12",
         "DCT16",
         "DCT24",
+        "KMAP_CHI2",
+        "KMAP_INT",
+        "KMAP_HELL",
+        "NYS_RBF",
+        "NYS_LOG",
+        "NYS_KMOD",
+        "NYS_CAUCHY",
+        "FISHER4",
+        "FISHER8",
+        "CHISEL4",
+        "CHISEL8",
         0
     };
     enum CLA {
@@ -189,6 +312,18 @@ namespace TextureFeature
         CL_PCA_LDA,
         CL_MLP,
         CL_KNN,
+        CL_ANN_L2,   // hnsw graph index
+        CL_ANN_L1,   // hnsw
+        CL_ANN_COS,  // hnsw
+        CL_ANN_HELL, // hnsw
+        CL_ANN_CHI,  // hnsw
+        CL_KNN_HNSW,
+        CL_KNN_KDTREE, // flann
+        CL_KNN_KMEANS, // flann
+        CL_KNN_LSH,    // flann, binary features
+        CL_LINEAR_SVM, // dual coordinate descent, L2 loss
+        CL_LINEAR_LR,  // dual coordinate descent, logistic
+        CL_HAMMING,    // binary features, popcount scan / multi-index hash
         //CL_MAHALANOBIS,
         CL_MAX
     };
@@ -216,14 +351,37 @@ namespace TextureFeature
         "PCA_LDA",
         "MLP",
         "KNN",
+        "ANN_L2",
+        "ANN_L1",
+        "ANN_COS",
+        "ANN_HELL",
+        "ANN_CHI",
+        "KNN_HNSW",
+        "KNN_KDTREE",
+        "KNN_KMEANS",
+        "KNN_LSH",
+        "LINEAR_SVM",
+        "LINEAR_LR",
+        "HAMMING",
         //"MAHALANOBIS",
         0
     };
 
     cv::Ptr<Extractor>  createExtractor(int ext);
     cv::Ptr<Filter>     createFilter(int fil);
-    cv::Ptr<Classifier> createClassifier(int cla);
-    cv::Ptr<Verifier>   createVerifier(int ver);
+    cv::Ptr<Filter>     createFilter(const cv::String &chain); // "HELL+DCT8", names or enums
+    //
+    // opts: tuning knobs, name=value pairs like "budget=200" or "M=24,ef=128"
+    //   budget   svm reduced set vectors per one-vs-one pair (0: keep the support vectors)
+    //   bins     CL_SVM_INT2 lookup table size per dimension, O(dim) predict (0: binary search, exact)
+    //   M        hnsw links per node (16), the ANN_ and KNN_HNSW ones
+    //   efc      hnsw beam width while building (200)
+    //   ef       hnsw beam width while searching (64), recall <-> speed. also applies to a loaded graph
+    //   pca      CL_PCA / CL_PCA_LDA svd: 0 auto (exact, full or dual), 1 full, 2 dual, 3 randomized (approximate)
+    //   oversample, iters   randomized only: extra sketch columns (10), power iterations (2)
+    //
+    cv::Ptr<Classifier> createClassifier(int cla, const cv::String &opts="");
+    cv::Ptr<Verifier>   createVerifier(int ver, const cv::String &opts="");
 }
 
 